@@ -21,6 +21,7 @@
 #include "messages-model.h"
 
 #include <QPixmap>
+#include <QTimer>
 
 #include "debug.h"
 #include <KLocalizedString>
@@ -34,6 +35,11 @@
 #include <KTp/message-context.h>
 #include <KTp/Logger/scrollback-manager.h>
 
+// Number of messages before and after the last one shown which are processed ahead while idle
+static const int PrerenderDistance = 10;
+// Number of messages processed ahead at a time, to keep the GUI responsive
+static const int PrerenderBatch = 4;
+
 class MessagePrivate
 {
   public:
@@ -61,6 +67,9 @@ class MessagesModel::MessagesModelPrivate
     QHash<QString /*messageToken*/, QPersistentModelIndex> messagesByMessageToken;
     bool visible;
     bool logsLoaded;
+    // the filters only run on messages once they are shown, and around them in idle time
+    QTimer prerenderTimer;
+    int prerenderRow;
 };
 
 MessagesModel::MessagesModel(const Tp::AccountPtr &account, QObject *parent) :
@@ -70,7 +79,16 @@ MessagesModel::MessagesModel(const Tp::AccountPtr &account, QObject *parent) :
     d->account = account;
     d->visible = false;
 
+    d->prerenderRow = 0;
+    d->prerenderTimer.setSingleShot(true);
+    d->prerenderTimer.setInterval(0);
+    connect(&d->prerenderTimer, SIGNAL(timeout()), SLOT(prerenderMessages()));
+
+    connect(KTp::MessageProcessor::instance(), &KTp::MessageProcessor::largeMessageProgress,
+            this, &MessagesModel::onLargeMessageProgress);
+
     d->logManager = new ScrollbackManager(this);
+    d->logManager->setDeferredProcessing(true);
     d->logsLoaded = false;
     connect(d->logManager, SIGNAL(fetched(QList<KTp::Message>)), SLOT(onHistoryFetched(QList<KTp::Message>)));
 
@@ -280,7 +298,7 @@ void MessagesModel::onMessageReceived(const Tp::ReceivedMessage &message)
         }
         beginInsertRows(QModelIndex(), newMessageIndex, newMessageIndex);
 
-        d->messages.insert(newMessageIndex, KTp::MessageProcessor::instance()->processIncomingMessage(
+        d->messages.insert(newMessageIndex, KTp::MessageProcessor::instance()->deferIncomingMessage(
                                message, d->account, d->textChannel));
 
         endInsertRows();
@@ -308,7 +326,7 @@ void MessagesModel::onMessageSent(const Tp::Message &message, Tp::MessageSending
     int newMessageIndex = rowCount();
     beginInsertRows(QModelIndex(), newMessageIndex, newMessageIndex);
 
-    const KTp::Message &newMessage = KTp::MessageProcessor::instance()->processIncomingMessage(
+    const KTp::Message &newMessage = KTp::MessageProcessor::instance()->deferIncomingMessage(
                 message, d->account, d->textChannel);
     d->messages.append(newMessage);
 
@@ -343,7 +361,15 @@ QVariant MessagesModel::data(const QModelIndex &index, int role) const
 
         switch (role) {
         case TextRole:
+            // processes the message the first time, for every copy of it.
+            // a very large one is completed later, see onLargeMessageProgress()
+            m.message.processInChunks();
             result = m.message.finalizedMessage();
+            d->prerenderRow = index.row();
+            // restarting it on every row the view asks for would postpone it until the view is done
+            if (!d->prerenderTimer.isActive()) {
+                d->prerenderTimer.start();
+            }
             break;
         case TypeRole:
             if (m.message.type() == Tp::ChannelTextMessageTypeAction) {
@@ -394,6 +420,47 @@ QVariant MessagesModel::data(const QModelIndex &index, int role) const
     return result;
 }
 
+void MessagesModel::onLargeMessageProgress(const KTp::Message &message)
+{
+    // the message is most likely one of the last ones
+    for (int i = d->messages.size() - 1; i >= 0; --i) {
+        MessagePrivate &current = d->messages[i];
+        if (current.message.isDeferred() || !current.message.isPartial()) {
+            continue;
+        }
+
+        if (current.message.token() == message.token()
+                && current.message.time() == message.time()
+                && current.message.senderId() == message.senderId()) {
+            current.message = message;
+            const QModelIndex index = createIndex(i, 0);
+            Q_EMIT dataChanged(index, index, QVector<int>() << TextRole);
+            return;
+        }
+    }
+}
+
+void MessagesModel::prerenderMessages()
+{
+    int budget = PrerenderBatch;
+
+    // closest to the shown message first
+    for (int distance = 1; distance <= PrerenderDistance; ++distance) {
+        const int rows[] = { d->prerenderRow + distance, d->prerenderRow - distance };
+        for (int row : rows) {
+            if (row < 0 || row >= d->messages.size() || !d->messages.at(row).message.isDeferred()) {
+                continue;
+            }
+
+            if (budget-- == 0) {
+                d->prerenderTimer.start();
+                return;
+            }
+            d->messages.at(row).message.processInChunks();
+        }
+    }
+}
+
 int MessagesModel::rowCount(const QModelIndex &parent) const
 {
     Q_UNUSED(parent);
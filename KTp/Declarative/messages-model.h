@@ -109,6 +109,8 @@ class MessagesModel : public QAbstractListModel
     void onPendingMessageRemoved();
     bool verifyPendingOperation(Tp::PendingOperation *op);
     void onHistoryFetched(const QList<KTp::Message> &messages);
+    void prerenderMessages();
+    void onLargeMessageProgress(const KTp::Message &message);
 
   private:
     void setupChannelSignals(const Tp::TextChannelPtr &channel);
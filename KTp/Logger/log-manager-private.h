@@ -22,10 +22,12 @@
 
 #include "log-manager.h"
 
+#include <KPluginInfo>
 
 namespace KTp {
 
 class AbstractLoggerPlugin;
+class PluginRegistry;
 
 class LogManager::Private
 {
@@ -33,8 +35,14 @@ class LogManager::Private
     Private(LogManager *parent);
 
     void loadPlugins();
+    void loadPlugin(const KPluginInfo &pluginInfo);
+
+    /** The plugins which are loaded, waiting for the first ones if none is yet */
+    QList<KTp::AbstractLoggerPlugin*> readyPlugins();
 
     QList<KTp::AbstractLoggerPlugin*> plugins;
+    PluginRegistry *registry;
+    Tp::AccountManagerPtr accountManager;
 
     static LogManager* s_logManagerInstance;
   private:
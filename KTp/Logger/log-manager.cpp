@@ -27,9 +27,12 @@
 #include "pending-logger-entities-impl.h"
 #include "pending-logger-search-impl.h"
 
+#include "../plugin-registry-private.h"
+
 #include <KService>
-#include <KServiceTypeTrader>
 #include <KPluginInfo>
+#include <KPluginLoader>
+#include <KPluginFactory>
 
 #include "debug.h"
 
@@ -41,29 +44,49 @@ LogManager* LogManager::Private::s_logManagerInstance = nullptr;
 
 void LogManager::Private::loadPlugins()
 {
-    const KService::List services = KServiceTypeTrader::self()->query(
-                                         QLatin1String("KTpLogger/Plugin"),
-                                         QLatin1String("[X-KTp-PluginInfo-Version] == " KTP_LOGGER_PLUGIN_VERSION));
-
-    const KPluginInfo::List pluginInfos = KPluginInfo::fromServices(services);
-    Q_FOREACH (const KPluginInfo &pluginInfo, pluginInfos) {
-        const KService::Ptr service = pluginInfo.service();
-        KPluginFactory *factory = KPluginLoader(service->library()).factory();
-        if (factory) {
-            qCDebug(KTP_LOGGER) << "loaded factory :" << factory;
-            AbstractLoggerPlugin *plugin = factory->create<AbstractLoggerPlugin>(q);
-
-            if (plugin) {
-                qCDebug(KTP_LOGGER) << "loaded logger plugin : " << plugin;
-                plugins << plugin;
+    // The plugin libraries are loaded on worker threads, see readyPlugins()
+    registry = new PluginRegistry(QLatin1String("KTpLogger/Plugin"),
+                                  QLatin1String("[X-KTp-PluginInfo-Version] == " KTP_LOGGER_PLUGIN_VERSION),
+                                  q);
+    QObject::connect(registry, &PluginRegistry::pluginReady, q, [=](const KPluginInfo &pluginInfo) {
+        loadPlugin(pluginInfo);
+    });
+
+    registry->preload(registry->plugins());
+}
+
+void LogManager::Private::loadPlugin(const KPluginInfo &pluginInfo)
+{
+    KPluginFactory *factory = KPluginLoader(pluginInfo.libraryPath()).factory();
+    if (factory) {
+        qCDebug(KTP_LOGGER) << "loaded factory :" << factory;
+        AbstractLoggerPlugin *plugin = factory->create<AbstractLoggerPlugin>(q);
+
+        if (plugin) {
+            qCDebug(KTP_LOGGER) << "loaded logger plugin : " << plugin;
+            if (!accountManager.isNull()) {
+                plugin->setAccountManager(accountManager);
             }
-        } else {
-            qCWarning(KTP_LOGGER) << "error loading plugin :" << service->library();
+            plugins << plugin;
         }
+    } else {
+        qCWarning(KTP_LOGGER) << "error loading plugin :" << pluginInfo.libraryPath();
+    }
+}
+
+QList<KTp::AbstractLoggerPlugin*> LogManager::Private::readyPlugins()
+{
+    // Queries are answered by the plugins which are ready, but answering
+    // them with no plugin at all would wrongly report that there are no logs
+    if (plugins.isEmpty() && registry->isPreloading()) {
+        registry->waitForPreloaded();
     }
+
+    return plugins;
 }
 
 LogManager::Private::Private(LogManager *parent):
+    registry(nullptr),
     q(parent)
 {
     loadPlugins();
@@ -91,15 +114,19 @@ LogManager::~LogManager()
 
 Tp::AccountManagerPtr LogManager::accountManager() const
 {
-    if (d->plugins.isEmpty()) {
+    const QList<KTp::AbstractLoggerPlugin*> plugins = d->readyPlugins();
+    if (plugins.isEmpty()) {
         return Tp::AccountManagerPtr();
     }
 
-    return d->plugins.first()->accountManager();
+    return plugins.first()->accountManager();
 }
 
 void LogManager::setAccountManager(const Tp::AccountManagerPtr &accountManager)
 {
+    // for the plugins which are still loading
+    d->accountManager = accountManager;
+
     Q_FOREACH (KTp::AbstractLoggerPlugin *plugin, d->plugins) {
         plugin->setAccountManager(accountManager);
     }
@@ -126,7 +153,7 @@ PendingLoggerEntities* LogManager::queryEntities(const Tp::AccountPtr& account)
 
 void LogManager::clearAccountLogs(const Tp::AccountPtr &account)
 {
-   Q_FOREACH (KTp::AbstractLoggerPlugin *plugin, d->plugins) {
+   Q_FOREACH (KTp::AbstractLoggerPlugin *plugin, d->readyPlugins()) {
         if (!plugin->handlesAccount(account)) {
             continue;
         }
@@ -138,7 +165,7 @@ void LogManager::clearAccountLogs(const Tp::AccountPtr &account)
 void LogManager::clearContactLogs(const Tp::AccountPtr &account,
                                   const KTp::LogEntity &entity)
 {
-    Q_FOREACH (KTp::AbstractLoggerPlugin *plugin, d->plugins) {
+    Q_FOREACH (KTp::AbstractLoggerPlugin *plugin, d->readyPlugins()) {
         if (!plugin->handlesAccount(account)) {
             continue;
         }
@@ -154,7 +181,7 @@ PendingLoggerSearch* LogManager::search(const QString& term)
 
 bool LogManager::logsExist(const Tp::AccountPtr &account, const KTp::LogEntity &contact)
 {
-    Q_FOREACH (KTp::AbstractLoggerPlugin *plugin, d->plugins) {
+    Q_FOREACH (KTp::AbstractLoggerPlugin *plugin, d->readyPlugins()) {
         if (!plugin->handlesAccount(account)) {
             continue;
         }
@@ -79,7 +79,7 @@ void PendingLoggerOperation::emitFinished()
 
 QList<AbstractLoggerPlugin*> PendingLoggerOperation::plugins() const
 {
-    return LogManager::instance()->d->plugins;
+    return LogManager::instance()->d->readyPlugins();
 }
 
 #include "moc_pending-logger-operation.cpp"
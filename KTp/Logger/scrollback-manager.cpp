@@ -21,6 +21,7 @@
 #include "scrollback-manager.h"
 
 #include "../message-processor.h"
+#include "../pending-message-processing.h"
 #include "log-entity.h"
 #include "log-manager.h"
 #include "pending-logger-dates.h"
@@ -36,7 +37,7 @@
 class ScrollbackManager::Private
 {
   public:
-    Private(): scrollbackLength(10)
+    Private(): scrollbackLength(10), deferredProcessing(false)
     {
     }
 
@@ -47,6 +48,7 @@ class ScrollbackManager::Private
     QList<QDate> datesCache;
     QList<KTp::LogMessage> messagesCache;
     QString fromMessageToken;
+    bool deferredProcessing;
 };
 
 ScrollbackManager::ScrollbackManager(QObject *parent)
@@ -112,6 +114,16 @@ int ScrollbackManager::scrollbackLength() const
     return d->scrollbackLength;
 }
 
+void ScrollbackManager::setDeferredProcessing(bool deferred)
+{
+    d->deferredProcessing = deferred;
+}
+
+bool ScrollbackManager::isDeferredProcessing() const
+{
+    return d->deferredProcessing;
+}
+
 void ScrollbackManager::fetchScrollback()
 {
     fetchHistory(d->scrollbackLength);
@@ -254,11 +266,24 @@ void ScrollbackManager::onEventsFinished(KTp::PendingLoggerOperation *op)
             continue;
         }
 
-        messages << KTp::MessageProcessor::instance()->processIncomingMessage(message, ctx);
+        messages << message;
     }
 
     d->messagesCache.clear();
     d->datesCache.clear();
 
-    Q_EMIT fetched(messages);
+    if (d->deferredProcessing) {
+        Q_EMIT fetched(KTp::MessageProcessor::instance()->deferIncomingMessages(messages, ctx));
+        return;
+    }
+
+    // Run the filters off the GUI thread where possible, history can be long
+    KTp::PendingMessageProcessing *processing = KTp::MessageProcessor::instance()->processIncomingMessagesAsync(messages, ctx);
+    connect(processing, SIGNAL(finished(KTp::PendingMessageProcessing*)),
+            this, SLOT(onMessagesProcessed(KTp::PendingMessageProcessing*)));
+}
+
+void ScrollbackManager::onMessagesProcessed(KTp::PendingMessageProcessing *op)
+{
+    Q_EMIT fetched(op->messages());
 }
@@ -25,6 +25,7 @@
 
 namespace KTp {
 class PendingLoggerOperation;
+class PendingMessageProcessing;
 }
 
 class KTPCOMMONINTERNALS_EXPORT ScrollbackManager : public QObject
@@ -54,6 +55,14 @@ public:
 
     int scrollbackLength() const;
 
+    /**
+     * When enabled, fetched messages are not run through the message filters
+     * up front, but only once their content is needed, see KTp::Message::isDeferred().
+     * Disabled by default.
+     */
+    void setDeferredProcessing(bool deferred);
+    bool isDeferredProcessing() const;
+
     /**
      * Fetches last N message,s as set via setFetchAmount()
      */
@@ -72,6 +81,7 @@ Q_SIGNALS:
 private Q_SLOTS:
     void onDatesFinished(KTp::PendingLoggerOperation *po);
     void onEventsFinished(KTp::PendingLoggerOperation *po);
+    void onMessagesProcessed(KTp::PendingMessageProcessing *op);
 
 private:
     class Private;
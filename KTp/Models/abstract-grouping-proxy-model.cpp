@@ -24,111 +24,145 @@
 #include <QTimer>
 
 #include "debug.h"
+#include "types.h"
 
 
 class KTp::AbstractGroupingProxyModel::Private
 {
 public:
+    /* Every row of this model is a node in a flat array, referred to by its position in it.
+     * Group nodes are at the top level, below them one node per source row in that group,
+     * and below those nodes mirroring the children of the source row, in the same order.
+     *
+     * Indexes of this model carry the node of their parent plus one, 0 being the root.
+     */
+    struct Node
+    {
+        Node() : parent(-1), row(-1), sourceRow(-1), forced(false) { }
+
+        int parent;             // -1 for groups
+        int row;                // row under the parent in this model
+        int sourceRow;          // row under the parent in the source model, -1 for groups
+        QVector<int> children;
+        QString group;          // groups only
+        bool forced;            // groups only
+    };
+
     QAbstractItemModel *source;
 
-    //keep a cache of what groups an item belongs to
-    QHash<QPersistentModelIndex, QSet<QString> > groupCache;
+    QVector<Node> nodes;
+    QVector<int> freeNodes;
 
-    //item -> groups
-    QMultiHash<QPersistentModelIndex, ProxyNode*> proxyMap;
-    QHash<QString, GroupNode*> groupMap;
-};
+    //group nodes, in row order
+    QVector<int> groups;
+    QHash<QString, int> groupMap;
 
-class ProxyNode : public QStandardItem
-{
-public:
-    ProxyNode(const QPersistentModelIndex &sourceIndex);
-    QVariant data(int role) const override;
-    void changed(); //expose protected method in QStandardItem
-    QString group() const;
-private:
-    const QPersistentModelIndex m_sourceIndex;
-};
+    //top level source row -> its proxy nodes, one per group it belongs to
+    QVector<QVector<int> > sourceNodes;
 
-class GroupNode : public QStandardItem {
-public:
-    GroupNode(const QString &groupId);
-    QString group() const;
-    QVariant data(int role) const override;
-    bool forced() const;
-    void changed(); //expose protected method in QStandardItem
-    void setForced(bool forced);
-private:
-    const QString m_groupId;
-    bool m_forced;
-};
+    int allocate();
+    void release(int node);
+    int addGroup(const QString &group);
+    void clear();
 
+    const QVector<int> &children(int node) const;
+    int nodeFor(const QModelIndex &index) const;
+    void reindex(int node, int from);
 
-ProxyNode::ProxyNode(const QPersistentModelIndex &sourceIndex):
-    QStandardItem(),
-    m_sourceIndex(sourceIndex)
-{
-}
+    QModelIndex sourceIndex(int node) const;
+    QVector<int> nodesForSource(const QModelIndex &sourceIndex) const;
+};
 
-QVariant ProxyNode::data(int role) const
+int KTp::AbstractGroupingProxyModel::Private::allocate()
 {
-    return m_sourceIndex.data(role);
+    if (!freeNodes.isEmpty()) {
+        return freeNodes.takeLast();
+    }
+    nodes.append(Node());
+    return nodes.size() - 1;
 }
 
-void ProxyNode::changed()
+void KTp::AbstractGroupingProxyModel::Private::release(int node)
 {
-    QStandardItem::emitDataChanged();
+    Q_FOREACH (int child, nodes.at(node).children) {
+        release(child);
+    }
+    nodes[node] = Node();
+    freeNodes.append(node);
 }
 
-QString ProxyNode::group() const
+int KTp::AbstractGroupingProxyModel::Private::addGroup(const QString &group)
 {
-    //FIXME is this a hack?
-    GroupNode *groupNode = static_cast<GroupNode*>(parent());
-    if (groupNode) {
-        return groupNode->group();
-    }
-    return QString();
+    const int node = allocate();
+    nodes[node].group = group;
+    nodes[node].row = groups.size();
+    groups.append(node);
+    groupMap.insert(group, node);
+    return node;
 }
 
-
-
-GroupNode::GroupNode(const QString &groupId):
-    QStandardItem(),
-    m_groupId(groupId),
-    m_forced(false)
+void KTp::AbstractGroupingProxyModel::Private::clear()
 {
+    nodes.clear();
+    freeNodes.clear();
+    groups.clear();
+    groupMap.clear();
+    sourceNodes.clear();
 }
 
-QString GroupNode::group() const
+const QVector<int> &KTp::AbstractGroupingProxyModel::Private::children(int node) const
 {
-    return m_groupId;
+    return node < 0 ? groups : nodes.at(node).children;
 }
 
-QVariant GroupNode::data(int role) const
+int KTp::AbstractGroupingProxyModel::Private::nodeFor(const QModelIndex &index) const
 {
-    KTp::AbstractGroupingProxyModel *proxyModel = qobject_cast<KTp::AbstractGroupingProxyModel*>(model());
-    Q_ASSERT(proxyModel);
-    return proxyModel->dataForGroup(m_groupId, role);
+    return children(int(index.internalId()) - 1).at(index.row());
 }
 
-void GroupNode::setForced(bool forced)
+void KTp::AbstractGroupingProxyModel::Private::reindex(int node, int from)
 {
-    m_forced = forced;
+    const QVector<int> &siblings = children(node);
+    for (int i = from; i < siblings.size(); i++) {
+        nodes[siblings.at(i)].row = i;
+    }
 }
 
-bool GroupNode::forced() const
+QModelIndex KTp::AbstractGroupingProxyModel::Private::sourceIndex(int node) const
 {
-    return m_forced;
+    const Node &n = nodes.at(node);
+    if (n.sourceRow < 0) {
+        return QModelIndex();
+    }
+    return source->index(n.sourceRow, 0, sourceIndex(n.parent));
 }
 
-void GroupNode::changed()
+QVector<int> KTp::AbstractGroupingProxyModel::Private::nodesForSource(const QModelIndex &sourceIndex) const
 {
-    QStandardItem::emitDataChanged();
+    if (!sourceIndex.parent().isValid()) {
+        return sourceNodes.value(sourceIndex.row());
+    }
+
+    QVector<int> result;
+    Q_FOREACH (int parent, nodesForSource(sourceIndex.parent())) {
+        Q_FOREACH (int child, nodes.at(parent).children) {
+            if (nodes.at(child).sourceRow == sourceIndex.row()) {
+                result.append(child);
+                break;
+            }
+        }
+    }
+    return result;
 }
 
 
+//the online count is up to ContactsFilterModel, which knows which members are shown
+static const QVector<int> s_countRoles = QVector<int>()
+        << KTp::HeaderTotalUsersRole;
+
+
 KTp::AbstractGroupingProxyModel::AbstractGroupingProxyModel(QAbstractItemModel *source):
-    QStandardItemModel(source),
+    QAbstractItemModel(source),
     d(new KTp::AbstractGroupingProxyModel::Private())
 {
     d->source = source;
@@ -143,6 +177,71 @@ KTp::AbstractGroupingProxyModel::~AbstractGroupingProxyModel()
     delete d;
 }
 
+QModelIndex KTp::AbstractGroupingProxyModel::index(int row, int column, const QModelIndex &parent) const
+{
+    if (column != 0 || row < 0) {
+        return QModelIndex();
+    }
+
+    const int parentNode = parent.isValid() ? d->nodeFor(parent) : -1;
+    if (row >= d->children(parentNode).size()) {
+        return QModelIndex();
+    }
+    return createIndex(row, column, quintptr(parentNode + 1));
+}
+
+QModelIndex KTp::AbstractGroupingProxyModel::parent(const QModelIndex &child) const
+{
+    if (!child.isValid() || child.internalId() == 0) {
+        return QModelIndex();
+    }
+    return indexForNode(int(child.internalId()) - 1);
+}
+
+int KTp::AbstractGroupingProxyModel::rowCount(const QModelIndex &parent) const
+{
+    if (parent.column() > 0) {
+        return 0;
+    }
+    return d->children(parent.isValid() ? d->nodeFor(parent) : -1).size();
+}
+
+int KTp::AbstractGroupingProxyModel::columnCount(const QModelIndex &parent) const
+{
+    Q_UNUSED(parent);
+    return 1;
+}
+
+QVariant KTp::AbstractGroupingProxyModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid()) {
+        return QVariant();
+    }
+
+    const int node = d->nodeFor(index);
+    const Private::Node &n = d->nodes.at(node);
+    if (n.sourceRow < 0) {
+        if (role == KTp::HeaderTotalUsersRole) {
+            return n.children.size();
+        }
+        return dataForGroup(n.group, role);
+    }
+    return d->sourceIndex(node).data(role);
+}
+
+Qt::ItemFlags KTp::AbstractGroupingProxyModel::flags(const QModelIndex &index) const
+{
+    if (!index.isValid()) {
+        return Qt::NoItemFlags;
+    }
+
+    const int node = d->nodeFor(index);
+    if (d->nodes.at(node).sourceRow < 0) {
+        return Qt::ItemIsSelectable | Qt::ItemIsEnabled;
+    }
+    return d->source->flags(d->sourceIndex(node));
+}
+
 QHash<int, QByteArray> KTp::AbstractGroupingProxyModel::roleNames() const
 {
     return d->source->roleNames();
@@ -150,35 +249,43 @@ QHash<int, QByteArray> KTp::AbstractGroupingProxyModel::roleNames() const
 
 void KTp::AbstractGroupingProxyModel::forceGroup(const QString &group)
 {
-    GroupNode* groupNode = itemForGroup(group);
-    groupNode->setForced(true);
+    d->nodes[nodeForGroup(group)].forced = true;
 }
 
 void KTp::AbstractGroupingProxyModel::unforceGroup(const QString &group)
 {
-    GroupNode* groupNode = d->groupMap[group];
-    if (!groupNode) {
+    const QHash<QString, int>::const_iterator it = d->groupMap.constFind(group);
+    if (it == d->groupMap.constEnd()) {
         return;
     }
 
     //mark that this group can be removed when it's empty
-    groupNode->setForced(false);
+    d->nodes[it.value()].forced = false;
 
     //if group is already empty remove it
-    if (groupNode->rowCount() == 0) {
-        takeRow(groupNode->row());
-        d->groupMap.remove(groupNode->group());
-    }
+    removeGroupIfEmpty(it.value());
+}
+
+QVector<int> KTp::AbstractGroupingProxyModel::groupRoles() const
+{
+    return QVector<int>();
 }
 
 void KTp::AbstractGroupingProxyModel::groupChanged(const QString &group)
 {
-    GroupNode *node = d->groupMap[group];
-    if (node) {
-        node->changed();
+    const QHash<QString, int>::const_iterator it = d->groupMap.constFind(group);
+    if (it != d->groupMap.constEnd()) {
+        const QModelIndex groupIndex = indexForNode(it.value());
+        Q_EMIT dataChanged(groupIndex, groupIndex);
     }
 }
 
+QModelIndex KTp::AbstractGroupingProxyModel::indexForNode(int node) const
+{
+    const Private::Node &n = d->nodes.at(node);
+    return createIndex(n.row, 0, quintptr(n.parent + 1));
+}
+
 
 /* Called when source items inserts a row
  *
@@ -191,89 +298,269 @@ void KTp::AbstractGroupingProxyModel::onRowsInserted(const QModelIndex &sourcePa
 {
     //if top level in root model
     if (!sourceParent.isValid()) {
-        for (int i = start; i <= end; i++) {
-            QModelIndex index = d->source->index(i, 0, sourceParent);
-            Q_FOREACH(const QString &group, groupsForIndex(index)) {
-                addProxyNode(index, itemForGroup(group));
+        //rows after the new ones moved down
+        d->sourceNodes.insert(start, end - start + 1, QVector<int>());
+        for (int i = end + 1; i < d->sourceNodes.size(); i++) {
+            Q_FOREACH (int node, d->sourceNodes.at(i)) {
+                d->nodes[node].sourceRow = i;
             }
         }
+
+        addSourceRows(start, end, true);
     } else {
-        for (int i = start; i <= end; i++) {
-            QModelIndex index = d->source->index(i, 0, sourceParent);
-            QHash<QPersistentModelIndex, ProxyNode*>::const_iterator it = d->proxyMap.constFind(sourceParent);
-            while (it != d->proxyMap.constEnd()  && it.key() == sourceParent) {
-                addProxyNode(index, it.value());
-                it++;
-            }
+        Q_FOREACH (int node, d->nodesForSource(sourceParent)) {
+            addChildNodes(node, sourceParent, start, end);
         }
     }
 }
 
-#include <KTp/types.h>
+void KTp::AbstractGroupingProxyModel::populate()
+{
+    const int rows = d->source->rowCount();
+    d->sourceNodes.resize(rows);
+    if (rows > 0) {
+        addSourceRows(0, rows - 1, false);
+    }
+}
 
-void KTp::AbstractGroupingProxyModel::addProxyNode(const QModelIndex &sourceIndex, QStandardItem *parent)
+void KTp::AbstractGroupingProxyModel::addSourceRows(int start, int end, bool notify)
 {
-    Q_ASSERT(sourceIndex.isValid());
-    if (!sourceIndex.isValid()) {
-        return;
+    //work out the whole layout first, so that views see one insertion per group rather than one per row
+    QStringList groupOrder;
+    QHash<QString, QVector<int> > groupRows;
+    for (int i = start; i <= end; i++) {
+        Q_FOREACH(const QString &group, groupsForIndex(d->source->index(i, 0))) {
+            QHash<QString, QVector<int> >::iterator it = groupRows.find(group);
+            if (it == groupRows.end()) {
+                it = groupRows.insert(group, QVector<int>());
+                groupOrder.append(group);
+            }
+            it.value().append(i);
+        }
+    }
+
+    QStringList newGroups;
+    Q_FOREACH (const QString &group, groupOrder) {
+        if (!d->groupMap.contains(group)) {
+            newGroups.append(group);
+        }
+    }
+    if (!newGroups.isEmpty()) {
+        if (notify) {
+            beginInsertRows(QModelIndex(), d->groups.size(), d->groups.size() + newGroups.size() - 1);
+        }
+        Q_FOREACH (const QString &group, newGroups) {
+            d->addGroup(group);
+        }
+        if (notify) {
+            endInsertRows();
+        }
     }
 
-    ProxyNode *proxyNode = new ProxyNode(sourceIndex);
-    d->proxyMap.insertMulti(sourceIndex, proxyNode);
-    parent->appendRow(proxyNode);
+    QVector<int> parents;
+    Q_FOREACH (const QString &group, groupOrder) {
+        const QVector<int> rows = groupRows.value(group);
+        const int groupNode = d->groupMap.value(group);
+        const int first = d->nodes.at(groupNode).children.size();
 
-    //add proxy nodes for all children of this sourceIndex
-    for (int i=0; i < d->source->rowCount(sourceIndex); i++) {
-        addProxyNode(sourceIndex.child(i,0), proxyNode);
+        if (notify) {
+            beginInsertRows(indexForNode(groupNode), first, first + rows.size() - 1);
+        }
+        Q_FOREACH (int sourceRow, rows) {
+            const QModelIndex sourceIndex = d->source->index(sourceRow, 0);
+            const int node = d->allocate();
+            d->nodes[node].parent = groupNode;
+            d->nodes[node].row = d->nodes.at(groupNode).children.size();
+            d->nodes[node].sourceRow = sourceRow;
+            d->nodes[groupNode].children.append(node);
+            d->sourceNodes[sourceRow].append(node);
+
+            if (d->source->rowCount(sourceIndex) > 0) {
+                parents.append(node);
+            }
+        }
+        if (notify) {
+            endInsertRows();
+            countsChanged(groupNode, s_countRoles);
+        }
     }
 
+    //add proxy nodes for all children of the new rows
+    Q_FOREACH (int node, parents) {
+        const QModelIndex sourceIndex = d->sourceIndex(node);
+        addChildNodes(node, sourceIndex, 0, d->source->rowCount(sourceIndex) - 1, notify);
+    }
 }
 
-void KTp::AbstractGroupingProxyModel::removeProxyNodes(const QModelIndex &sourceIndex, const QList<ProxyNode *> &removedItems)
+void KTp::AbstractGroupingProxyModel::addProxyNode(int sourceRow, int groupNode)
 {
-    Q_FOREACH(ProxyNode *proxy, removedItems) {
-        QStandardItem *parentItem = proxy->parent();
+    const QModelIndex sourceIndex = d->source->index(sourceRow, 0);
+    const int node = d->allocate();
+    const int row = d->nodes.at(groupNode).children.size();
+
+    beginInsertRows(indexForNode(groupNode), row, row);
+    d->nodes[node].parent = groupNode;
+    d->nodes[node].row = row;
+    d->nodes[node].sourceRow = sourceRow;
+    d->nodes[groupNode].children.append(node);
+    d->sourceNodes[sourceRow].append(node);
+    endInsertRows();
+    countsChanged(groupNode, s_countRoles);
+
+    //add proxy nodes for all children of this source row
+    const int children = d->source->rowCount(sourceIndex);
+    if (children > 0) {
+        addChildNodes(node, sourceIndex, 0, children - 1);
+    }
+}
+
+void KTp::AbstractGroupingProxyModel::addChildNodes(int node, const QModelIndex &sourceParent, int start, int end, bool notify)
+{
+    QVector<int> added;
+    added.reserve(end - start + 1);
+    for (int i = start; i <= end; i++) {
+        added.append(d->allocate());
+    }
+
+    if (notify) {
+        beginInsertRows(indexForNode(node), start, end);
+    }
+    QVector<int> &children = d->nodes[node].children;
+    children.insert(start, added.size(), -1);
+    for (int i = 0; i < added.size(); i++) {
+        children[start + i] = added.at(i);
+        d->nodes[added.at(i)].parent = node;
+    }
+    //children are in the same order as in the source
+    for (int i = start; i < children.size(); i++) {
+        d->nodes[children.at(i)].row = i;
+        d->nodes[children.at(i)].sourceRow = i;
+    }
+    if (notify) {
+        endInsertRows();
+    }
 
-        //also remove child items of this proxy node from the proxy map
-        for (int i = 0 ; i < d->source->rowCount(sourceIndex) ; i++) {
-            //we always remove child(0) because we're deleting the first child each time
-            removeProxyNodes(sourceIndex.child(i,0), QList<ProxyNode*>() << dynamic_cast<ProxyNode*>(proxy->child(0)));
+    for (int i = start; i <= end; i++) {
+        const QModelIndex sourceIndex = d->source->index(i, 0, sourceParent);
+        const int grandChildren = d->source->rowCount(sourceIndex);
+        if (grandChildren > 0) {
+            addChildNodes(added.at(i - start), sourceIndex, 0, grandChildren - 1, notify);
         }
+    }
+}
 
-        parentItem->removeRow(proxy->row());
-        d->proxyMap.remove(sourceIndex, proxy);
+void KTp::AbstractGroupingProxyModel::removeProxyNode(int node)
+{
+    const int parent = d->nodes.at(node).parent;
+    const int row = d->nodes.at(node).row;
+    const bool inGroup = d->nodes.at(parent).sourceRow < 0;
+
+    beginRemoveRows(indexForNode(parent), row, row);
+    d->nodes[parent].children.remove(row);
+    d->reindex(parent, row);
+    d->release(node);
+    endRemoveRows();
+
+    if (inGroup) {
+        countsChanged(parent, s_countRoles);
+    }
+}
 
-        //if the parent item to this proxy node is now empty, and is a top level item
-        if (parentItem->rowCount() == 0 && parentItem->parent() == nullptr ) {
-            GroupNode* groupNode = dynamic_cast<GroupNode*>(parentItem);
+void KTp::AbstractGroupingProxyModel::countsChanged(int groupNode, const QVector<int> &roles)
+{
+    const QModelIndex groupIndex = indexForNode(groupNode);
+    Q_EMIT dataChanged(groupIndex, groupIndex, roles);
+}
 
-            //do not delete forced groups
-            if (groupNode->forced() == false) {
-                takeRow(groupNode->row());
-                d->groupMap.remove(groupNode->group());
-            }
-        }
+void KTp::AbstractGroupingProxyModel::removeGroupIfEmpty(int groupNode)
+{
+    const Private::Node &group = d->nodes.at(groupNode);
+
+    //do not delete forced groups
+    if (!group.children.isEmpty() || group.forced) {
+        return;
     }
+
+    const int row = group.row;
+    beginRemoveRows(QModelIndex(), row, row);
+    d->groupMap.remove(group.group);
+    d->groups.remove(row);
+    d->reindex(-1, row);
+    d->release(groupNode);
+    endRemoveRows();
 }
 
 /*
- * Called when a row is remove from the source model model
- * Find all existing proxy models and delete thems
+ * Called when a row is about to be removed from the source model
+ * Find all existing proxy nodes and delete them
+ *
+ * The source rows are still there, so the rows after them keep their source row until onRowsRemoved()
 */
+void KTp::AbstractGroupingProxyModel::onRowsAboutToBeRemoved(const QModelIndex &sourceParent, int start, int end)
+{
+    if (!sourceParent.isValid()) {
+        for (int i = start; i <= end; i++) {
+            const QVector<int> nodes = d->sourceNodes.at(i);
+            d->sourceNodes[i].clear();
+            Q_FOREACH (int node, nodes) {
+                const int groupNode = d->nodes.at(node).parent;
+                removeProxyNode(node);
+                removeGroupIfEmpty(groupNode);
+            }
+        }
+    } else {
+        Q_FOREACH (int node, d->nodesForSource(sourceParent)) {
+            for (int i = end; i >= start; i--) {
+                removeProxyNode(d->nodes.at(node).children.at(i));
+            }
+        }
+    }
+}
+
 void KTp::AbstractGroupingProxyModel::onRowsRemoved(const QModelIndex &sourceParent, int start, int end)
 {
-    for (int i = start; i<=end; i++) {
-        QPersistentModelIndex index = d->source->index(i, 0, sourceParent);
-        QList<ProxyNode *> itemsToRemove;
+    if (!sourceParent.isValid()) {
+        d->sourceNodes.remove(start, end - start + 1);
+        for (int i = start; i < d->sourceNodes.size(); i++) {
+            Q_FOREACH (int node, d->sourceNodes.at(i)) {
+                d->nodes[node].sourceRow = i;
+            }
+        }
+    } else {
+        Q_FOREACH (int node, d->nodesForSource(sourceParent)) {
+            const QVector<int> &children = d->nodes.at(node).children;
+            for (int i = start; i < children.size(); i++) {
+                d->nodes[children.at(i)].sourceRow = i;
+            }
+        }
+    }
+}
 
-        QHash<QPersistentModelIndex, ProxyNode*>::const_iterator it = d->proxyMap.constFind(index);
-        while (it != d->proxyMap.constEnd() && it.key() == index) {
-//             qCDebug(KTP_MODELS) << "removing row" << index.data();
-            itemsToRemove.append(it.value());
-            ++it;
+/*
+ * Called when the source model moves rows
+ * Top level rows are not ordered here so only where they point to changes, children mirror
+ * the order of the source so we start over for those
+ */
+void KTp::AbstractGroupingProxyModel::onRowsMoved(const QModelIndex &sourceParent, int start, int end, const QModelIndex &destinationParent, int destinationRow)
+{
+    if (sourceParent.isValid() || destinationParent.isValid()) {
+        onModelReset();
+        return;
+    }
+
+    const int count = end - start + 1;
+    const QVector<QVector<int> > moved = d->sourceNodes.mid(start, count);
+    const int to = destinationRow > end ? destinationRow - count : destinationRow;
+    d->sourceNodes.remove(start, count);
+    d->sourceNodes.insert(to, count, QVector<int>());
+    for (int i = 0; i < count; i++) {
+        d->sourceNodes[to + i] = moved.at(i);
+    }
+
+    for (int i = qMin(start, to); i <= qMax(end, to + count - 1); i++) {
+        Q_FOREACH (int node, d->sourceNodes.at(i)) {
+            d->nodes[node].sourceRow = i;
         }
-        d->groupCache.remove(index);
-        removeProxyNodes(index, itemsToRemove);
     }
 }
 
@@ -283,55 +570,56 @@ void KTp::AbstractGroupingProxyModel::onRowsRemoved(const QModelIndex &sourcePar
  * Find all proxy nodes, and make dataChanged() get emitted
  */
 
-void KTp::AbstractGroupingProxyModel::onDataChanged(const QModelIndex &sourceTopLeft, const QModelIndex &sourceBottomRight)
+void KTp::AbstractGroupingProxyModel::onDataChanged(const QModelIndex &sourceTopLeft, const QModelIndex &sourceBottomRight, const QVector<int> &roles)
 {
+    //presence and the like change a lot more often than groups, only look for new groups when needed
+    bool groupsMayChange = roles.isEmpty();
+    if (!groupsMayChange) {
+        const QVector<int> groupRoles = this->groupRoles();
+        groupsMayChange = groupRoles.isEmpty();
+        Q_FOREACH (int role, groupRoles) {
+            if (roles.contains(role)) {
+                groupsMayChange = true;
+                break;
+            }
+        }
+    }
+
     for (int i = sourceTopLeft.row(); i <= sourceBottomRight.row(); i++) {
-        QPersistentModelIndex index = sourceTopLeft.sibling(i,0);
+        const QModelIndex index = sourceTopLeft.sibling(i,0);
         if (!index.isValid()) {
             continue;
         }
 
         //if top level item
-        if (!sourceTopLeft.parent().isValid()) {
-            //groupsSet has changed...update as appropriate
-            QSet<QString> itemGroups = groupsForIndex(d->source->index(i, 0, sourceTopLeft.parent()));
-            if (d->groupCache[index] != itemGroups) {
-                d->groupCache[index] = itemGroups;
-
-                //loop through existing proxy nodes, and check each one is still valid.
-                QHash<QPersistentModelIndex, ProxyNode*>::const_iterator it = d->proxyMap.constFind(index);
-                QList<ProxyNode*> removedItems;
-                while (it != d->proxyMap.constEnd() && it.key() == index) {
-                    // if proxy's group is still in the item's groups.
-                    if (itemGroups.contains(it.value()->group())) {
-                        itemGroups.remove(it.value()->group());
-                    } else {
-                        //remove the proxy item
-                        //cache to list and remove once outside the const_iterator
-                        removedItems.append(it.value());
-
-                        qCDebug(KTP_MODELS) << "removing " << index.data().toString() << " from group " << it.value()->group();
-                    }
-                    ++it;
+        if (!sourceTopLeft.parent().isValid() && groupsMayChange) {
+            QSet<QString> itemGroups = groupsForIndex(index);
+
+            //loop through existing proxy nodes, and check each one is still valid.
+            Q_FOREACH (int node, d->sourceNodes.at(i)) {
+                const int groupNode = d->nodes.at(node).parent;
+                // if proxy's group is still in the item's groups.
+                if (!itemGroups.remove(d->nodes.at(groupNode).group)) {
+                    qCDebug(KTP_MODELS) << "removing " << index.data().toString() << " from group " << d->nodes.at(groupNode).group;
+
+                    d->sourceNodes[i].removeOne(node);
+                    removeProxyNode(node);
+                    removeGroupIfEmpty(groupNode);
                 }
+            }
 
-                removeProxyNodes(index, removedItems);
-
-                //remaining items in itemGroups are now the new groups
-                Q_FOREACH(const QString &group, itemGroups) {
-                    GroupNode *groupNode = itemForGroup(group);
-                    addProxyNode(index, groupNode);
+            //remaining items in itemGroups are now the new groups
+            Q_FOREACH(const QString &group, itemGroups) {
+                addProxyNode(i, nodeForGroup(group));
 
-                    qCDebug(KTP_MODELS) << "adding " << index.data().toString() << " to group " << group;
-                }
+                qCDebug(KTP_MODELS) << "adding " << index.data().toString() << " to group " << group;
             }
         }
 
-        //mark all proxy nodes as changed
-        QHash<QPersistentModelIndex, ProxyNode*>::const_iterator it = d->proxyMap.constFind(index);
-        while (it != d->proxyMap.constEnd() && it.key() == index) {
-            it.value()->changed();
-            ++it;
+        //mark all proxy nodes as changed, passing on which roles did
+        Q_FOREACH (int node, d->nodesForSource(index)) {
+            const QModelIndex proxyIndex = indexForNode(node);
+            Q_EMIT dataChanged(proxyIndex, proxyIndex, roles);
         }
     }
 }
@@ -339,40 +627,53 @@ void KTp::AbstractGroupingProxyModel::onDataChanged(const QModelIndex &sourceTop
 
 void KTp::AbstractGroupingProxyModel::onLoad()
 {
+    //everything is new, a single reset is cheaper for views than any number of insertions
     if (d->source->rowCount() > 0) {
-        onRowsInserted(QModelIndex(), 0, d->source->rowCount()-1);
+        beginResetModel();
+        populate();
+        endResetModel();
     }
     connect(d->source, SIGNAL(modelReset()), SLOT(onModelReset()));
+    connect(d->source, SIGNAL(layoutChanged()), SLOT(onModelReset()));
     connect(d->source, SIGNAL(rowsInserted(QModelIndex, int,int)), SLOT(onRowsInserted(QModelIndex,int,int)));
-    connect(d->source, SIGNAL(rowsAboutToBeRemoved(QModelIndex,int,int)), SLOT(onRowsRemoved(QModelIndex,int,int)));
-    connect(d->source, SIGNAL(dataChanged(QModelIndex,QModelIndex)), SLOT(onDataChanged(QModelIndex,QModelIndex)));
+    connect(d->source, SIGNAL(rowsAboutToBeRemoved(QModelIndex,int,int)), SLOT(onRowsAboutToBeRemoved(QModelIndex,int,int)));
+    connect(d->source, SIGNAL(rowsRemoved(QModelIndex,int,int)), SLOT(onRowsRemoved(QModelIndex,int,int)));
+    connect(d->source, SIGNAL(rowsMoved(QModelIndex,int,int,QModelIndex,int)), SLOT(onRowsMoved(QModelIndex,int,int,QModelIndex,int)));
+    connect(d->source, SIGNAL(dataChanged(QModelIndex,QModelIndex,QVector<int>)), SLOT(onDataChanged(QModelIndex,QModelIndex,QVector<int>)));
 }
 
-/* Called when source model gets reset
- * Delete all local caches/maps and wipe the current QStandardItemModel
+/* Called when source model gets reset, or reorders itself in ways we can't follow
+ * Delete all nodes, only keeping forced groups, and fill the model again
  */
 
 void KTp::AbstractGroupingProxyModel::onModelReset()
 {
-    clear();
-    d->groupCache.clear();
-    d->proxyMap.clear();
-    d->groupMap.clear();
-    qCDebug(KTP_MODELS) << "reset";
+    QStringList forcedGroups;
+    Q_FOREACH (int node, d->groups) {
+        if (d->nodes.at(node).forced) {
+            forcedGroups.append(d->nodes.at(node).group);
+        }
+    }
 
-    if (d->source->rowCount() > 0) {
-        onRowsInserted(QModelIndex(), 0, d->source->rowCount()-1);
+    beginResetModel();
+    d->clear();
+    Q_FOREACH (const QString &group, forcedGroups) {
+        d->nodes[d->addGroup(group)].forced = true;
     }
+    populate();
+    endResetModel();
+    qCDebug(KTP_MODELS) << "reset";
 }
 
-GroupNode* KTp::AbstractGroupingProxyModel::itemForGroup(const QString &group)
+int KTp::AbstractGroupingProxyModel::nodeForGroup(const QString &group)
 {
-    if (d->groupMap.contains(group)) {
-        return d->groupMap[group];
-    } else {
-        GroupNode* item = new GroupNode(group);
-        appendRow(item);
-        d->groupMap[group] = item;
-        return item;
+    const QHash<QString, int>::const_iterator it = d->groupMap.constFind(group);
+    if (it != d->groupMap.constEnd()) {
+        return it.value();
     }
+
+    beginInsertRows(QModelIndex(), d->groups.size(), d->groups.size());
+    const int node = d->addGroup(group);
+    endInsertRows();
+    return node;
 }
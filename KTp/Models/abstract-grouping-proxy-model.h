@@ -22,17 +22,15 @@
 #ifndef KTP_ABSTRACT_GROUPING_PROXY_MODEL_H
 #define KTP_ABSTRACT_GROUPING_PROXY_MODEL_H
 
-#include <QStandardItemModel>
+#include <QAbstractItemModel>
+#include <QSet>
 
 #include <KTp/Models/ktpmodels_export.h>
 
-class ProxyNode;
-class GroupNode;
-
 namespace KTp
 {
 
-class KTPMODELS_EXPORT AbstractGroupingProxyModel : public QStandardItemModel
+class KTPMODELS_EXPORT AbstractGroupingProxyModel : public QAbstractItemModel
 {
     Q_OBJECT
 public:
@@ -44,6 +42,12 @@ public:
 
     void groupChanged(const QString &group);
 
+    QModelIndex index(int row, int column, const QModelIndex &parent = QModelIndex()) const Q_DECL_OVERRIDE;
+    QModelIndex parent(const QModelIndex &child) const Q_DECL_OVERRIDE;
+    int rowCount(const QModelIndex &parent = QModelIndex()) const Q_DECL_OVERRIDE;
+    int columnCount(const QModelIndex &parent = QModelIndex()) const Q_DECL_OVERRIDE;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const Q_DECL_OVERRIDE;
+    Qt::ItemFlags flags(const QModelIndex &index) const Q_DECL_OVERRIDE;
     QHash<int, QByteArray> roleNames() const Q_DECL_OVERRIDE;
 
 //protected:
@@ -51,11 +55,16 @@ public:
     virtual QSet<QString> groupsForIndex(const QModelIndex &sourceIndex) const = 0;
     /** Equivalent of QAbstractItemModel::data() called for a specific group header*/
     virtual QVariant dataForGroup(const QString &group, int role) const = 0;
+    /** The roles groupsForIndex() depends on, changes to other roles never move an item to another group.
+     * The default, an empty list, means any role might*/
+    virtual QVector<int> groupRoles() const;
 
 private Q_SLOTS:
     void onRowsInserted(const QModelIndex &sourceParent, int start, int end);
+    void onRowsAboutToBeRemoved(const QModelIndex &sourceParent, int start, int end);
     void onRowsRemoved(const QModelIndex &sourceParent, int start, int end);
-    void onDataChanged(const QModelIndex &sourceTopLeft, const QModelIndex &sourceBottomRight);
+    void onRowsMoved(const QModelIndex &sourceParent, int start, int end, const QModelIndex &destinationParent, int destinationRow);
+    void onDataChanged(const QModelIndex &sourceTopLeft, const QModelIndex &sourceBottomRight, const QVector<int> &roles);
     void onModelReset();
     void onLoad();
 
@@ -65,14 +74,27 @@ private:
     Private *d;
 
 
-    /** Create a new proxyNode appended to the given parent in this model*/
-    void addProxyNode(const QModelIndex &sourceIndex, QStandardItem *parent);
+    /** Returns the index in this model of the given node*/
+    QModelIndex indexForNode(int node) const;
 
-    void removeProxyNodes(const QModelIndex &sourceIndex, const QList<ProxyNode *> &removedItems);
+    /** Fill the model from all the rows of the source, between beginResetModel() and endResetModel()*/
+    void populate();
+    /** Create the proxy nodes of the top level source rows @p start to @p end, adding all the new rows of a group at once*/
+    void addSourceRows(int start, int end, bool notify);
+    /** Create a new proxy node for a top level source row, appended to the given group node*/
+    void addProxyNode(int sourceRow, int groupNode);
+    /** Create proxy nodes under @p node for the children @p start to @p end of the source index it maps to*/
+    void addChildNodes(int node, const QModelIndex &sourceParent, int start, int end, bool notify = true);
 
+    /** Remove a proxy node and everything below it*/
+    void removeProxyNode(int node);
 
-    /** Returns the standard Item belonging to a particular group name. Creating one if needed*/
-    GroupNode *itemForGroup(const QString &group);
+    /** Returns the node belonging to a particular group name. Creating one if needed*/
+    int nodeForGroup(const QString &group);
+    /** Remove a group node if it is empty and not forced*/
+    void removeGroupIfEmpty(int groupNode);
+    /** Emit dataChanged() for the member counts of a group*/
+    void countsChanged(int groupNode, const QVector<int> &roles);
 };
 
 }
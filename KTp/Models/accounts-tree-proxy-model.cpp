@@ -61,6 +61,11 @@ QSet<QString> KTp::AccountsTreeProxyModel::groupsForIndex(const QModelIndex &sou
 }
 
 
+QVector<int> KTp::AccountsTreeProxyModel::groupRoles() const
+{
+    return QVector<int>() << KTp::AccountRole;
+}
+
 QVariant KTp::AccountsTreeProxyModel::dataForGroup(const QString &group, int role) const
 {
     Tp::AccountPtr account;
@@ -0,0 +1,382 @@
+/*
+ * Trigram index for ranked contact search
+ *
+ * Copyright (C) 2026  KDE Telepathy developers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "contact-search-index-private.h"
+
+#include "presence.h"
+
+#include <algorithm>
+
+using namespace KTp;
+
+// how much of the score comes from presence rather than from the match
+static const qreal PresenceWeight = 0.15;
+// share of the query trigrams a fuzzy match needs
+static const qreal MinimumTrigramRatio = 0.5;
+
+ContactSearchIndex::ContactSearchIndex()
+{
+}
+
+void ContactSearchIndex::add(const QString &key, const QStringList &fields, Tp::ConnectionPresenceType presence)
+{
+    const QHash<QString, int>::const_iterator it = m_ids.constFind(key);
+    if (it != m_ids.constEnd()) {
+        m_documents[it.value()].refs++;
+        update(key, fields, presence);
+        return;
+    }
+
+    int id;
+    if (m_freeIds.isEmpty()) {
+        id = m_documents.size();
+        m_documents.append(Document());
+    } else {
+        id = m_freeIds.takeLast();
+    }
+
+    Document &document = m_documents[id];
+    document.key = key;
+    document.refs = 1;
+    document.presenceRank = KTp::Presence::sortPriority(presence);
+    Q_FOREACH (const QString &field, fields) {
+        document.fields.append(fold(field));
+        document.words.append(words(document.fields.last()));
+    }
+    document.trigrams = trigrams(document.words);
+
+    m_ids.insert(key, id);
+    index(id);
+}
+
+void ContactSearchIndex::update(const QString &key, const QStringList &fields, Tp::ConnectionPresenceType presence)
+{
+    const QHash<QString, int>::const_iterator it = m_ids.constFind(key);
+    if (it == m_ids.constEnd()) {
+        return;
+    }
+
+    Document &document = m_documents[it.value()];
+    document.presenceRank = KTp::Presence::sortPriority(presence);
+
+    QStringList folded;
+    Q_FOREACH (const QString &field, fields) {
+        folded.append(fold(field));
+    }
+
+    // presence changes are the common case, they don't touch the postings
+    if (folded == document.fields) {
+        return;
+    }
+
+    unindex(it.value());
+    document.fields = folded;
+    document.words.clear();
+    Q_FOREACH (const QString &field, folded) {
+        document.words.append(words(field));
+    }
+    document.trigrams = trigrams(document.words);
+    index(it.value());
+}
+
+void ContactSearchIndex::remove(const QString &key)
+{
+    const QHash<QString, int>::iterator it = m_ids.find(key);
+    if (it == m_ids.end()) {
+        return;
+    }
+
+    const int id = it.value();
+    if (--m_documents[id].refs > 0) {
+        return;
+    }
+
+    unindex(id);
+    m_documents[id] = Document();
+    m_freeIds.append(id);
+    m_ids.erase(it);
+}
+
+void ContactSearchIndex::clear()
+{
+    m_documents.clear();
+    m_freeIds.clear();
+    m_ids.clear();
+    m_postings.clear();
+}
+
+bool ContactSearchIndex::contains(const QString &key) const
+{
+    return m_ids.contains(key);
+}
+
+int ContactSearchIndex::size() const
+{
+    return m_ids.size();
+}
+
+QHash<QString, qreal> ContactSearchIndex::search(const QString &query) const
+{
+    QHash<QString, qreal> results;
+
+    const Query q = prepare(query);
+    if (q.text.isEmpty()) {
+        return results;
+    }
+
+    // A query word of three letters or more has a trigram inside it that every field
+    // containing the query shares. Shorter ones, like "ar" in "mark", only share the
+    // padded trigrams of word starts, so without such a word every contact is a candidate
+    bool hasLongWord = false;
+    Q_FOREACH (const QString &word, q.words) {
+        hasLongWord = hasLongWord || word.size() >= 3;
+    }
+    if (!hasLongWord) {
+        Q_FOREACH (int id, m_ids) {
+            const Document &document = m_documents.at(id);
+            const qreal s = score(document, q, sharedTrigrams(document.trigrams, q.trigrams));
+            if (s > 0) {
+                results.insert(document.key, s);
+            }
+        }
+        return results;
+    }
+
+    QHash<int, int> shared;
+    Q_FOREACH (quint64 trigram, q.trigrams) {
+        const QHash<quint64, QSet<int> >::const_iterator postings = m_postings.constFind(trigram);
+        if (postings == m_postings.constEnd()) {
+            continue;
+        }
+        Q_FOREACH (int id, postings.value()) {
+            shared[id]++;
+        }
+    }
+
+    for (QHash<int, int>::const_iterator it = shared.constBegin(); it != shared.constEnd(); ++it) {
+        const Document &document = m_documents.at(it.key());
+        const qreal s = score(document, q, it.value());
+        if (s > 0) {
+            results.insert(document.key, s);
+        }
+    }
+
+    return results;
+}
+
+qreal ContactSearchIndex::score(const QString &key, const QString &query) const
+{
+    const QHash<QString, int>::const_iterator it = m_ids.constFind(key);
+    if (it == m_ids.constEnd()) {
+        return 0;
+    }
+
+    const Query q = prepare(query);
+    if (q.text.isEmpty()) {
+        return 0;
+    }
+
+    const Document &document = m_documents.at(it.value());
+    return score(document, q, sharedTrigrams(document.trigrams, q.trigrams));
+}
+
+int ContactSearchIndex::sharedTrigrams(const QVector<quint64> &a, const QVector<quint64> &b)
+{
+    // both are sorted
+    int shared = 0;
+    QVector<quint64>::const_iterator i = a.constBegin();
+    QVector<quint64>::const_iterator j = b.constBegin();
+    while (i != a.constEnd() && j != b.constEnd()) {
+        if (*i < *j) {
+            ++i;
+        } else if (*j < *i) {
+            ++j;
+        } else {
+            ++shared;
+            ++i;
+            ++j;
+        }
+    }
+    return shared;
+}
+
+QString ContactSearchIndex::fold(const QString &string)
+{
+    // If we're being case-insensitve then we should also be "foreign character insensitive"
+    QString folded;
+    const QString normalized = string.normalized(QString::NormalizationForm_D);
+    folded.reserve(normalized.size());
+    Q_FOREACH (const QChar &c, normalized) {
+        if (c.category() != QChar::Mark_NonSpacing
+            && c.category() != QChar::Mark_SpacingCombining
+            && c.category() != QChar::Mark_Enclosing) {
+            folded.append(c);
+        }
+    }
+    return folded.toCaseFolded();
+}
+
+QStringList ContactSearchIndex::words(const QString &folded)
+{
+    QStringList result;
+    int start = -1;
+    for (int i = 0; i <= folded.size(); ++i) {
+        const bool inWord = i < folded.size() && folded.at(i).isLetterOrNumber();
+        if (inWord && start < 0) {
+            start = i;
+        } else if (!inWord && start >= 0) {
+            result.append(folded.mid(start, i - start));
+            start = -1;
+        }
+    }
+    return result;
+}
+
+QVector<quint64> ContactSearchIndex::trigrams(const QStringList &words)
+{
+    // words are padded so that their first letters and ends make trigrams
+    // of their own, which is what makes short prefixes searchable
+    QVector<quint64> result;
+    Q_FOREACH (const QString &word, words) {
+        const QString padded = QLatin1String("  ") + word + QLatin1Char(' ');
+        for (int i = 0; i + 2 < padded.size(); ++i) {
+            result.append(quint64(padded.at(i).unicode()) << 32
+                          | quint64(padded.at(i + 1).unicode()) << 16
+                          | quint64(padded.at(i + 2).unicode()));
+        }
+    }
+
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+int ContactSearchIndex::editDistance(const QString &a, const QString &b, int limit)
+{
+    // optimal string alignment distance, so that swapped letters count once
+    if (qAbs(a.size() - b.size()) > limit) {
+        return limit + 1;
+    }
+
+    QVector<int> previous2(b.size() + 1);
+    QVector<int> previous(b.size() + 1);
+    QVector<int> current(b.size() + 1);
+    for (int j = 0; j <= b.size(); ++j) {
+        previous[j] = j;
+    }
+
+    for (int i = 1; i <= a.size(); ++i) {
+        current[0] = i;
+        int rowMinimum = current[0];
+        for (int j = 1; j <= b.size(); ++j) {
+            const int cost = a.at(i - 1) == b.at(j - 1) ? 0 : 1;
+            current[j] = qMin(qMin(previous[j] + 1, current[j - 1] + 1), previous[j - 1] + cost);
+            if (i > 1 && j > 1 && a.at(i - 1) == b.at(j - 2) && a.at(i - 2) == b.at(j - 1)) {
+                current[j] = qMin(current[j], previous2[j - 2] + 1);
+            }
+            rowMinimum = qMin(rowMinimum, current[j]);
+        }
+        if (rowMinimum > limit) {
+            return limit + 1;
+        }
+        previous2.swap(previous);
+        previous.swap(current);
+    }
+
+    return previous[b.size()];
+}
+
+ContactSearchIndex::Query ContactSearchIndex::prepare(const QString &query)
+{
+    Query q;
+    q.text = fold(query).trimmed();
+    q.words = words(q.text);
+    q.trigrams = trigrams(q.words);
+    return q;
+}
+
+qreal ContactSearchIndex::score(const Document &document, const Query &query, int sharedTrigrams) const
+{
+    qreal match = 0;
+
+    Q_FOREACH (const QString &field, document.fields) {
+        if (field.startsWith(query.text)) {
+            match = 1.0;
+            break;
+        }
+
+        int index = field.indexOf(query.text);
+        while (index > 0 && match < 0.85) {
+            match = field.at(index - 1).isLetterOrNumber() ? qMax(match, 0.7) : 0.85;
+            index = field.indexOf(query.text, index + 1);
+        }
+    }
+
+    // typos: enough shared trigrams, or a word of the query close enough to a
+    // word (or the start of a word) of the contact
+    if (match == 0 && !query.trigrams.isEmpty()) {
+        const qreal ratio = qreal(sharedTrigrams) / query.trigrams.size();
+        if (ratio >= MinimumTrigramRatio) {
+            match = 0.6 * ratio;
+        }
+
+        Q_FOREACH (const QString &queryWord, query.words) {
+            if (queryWord.size() < 3) {
+                continue;
+            }
+            const int limit = queryWord.size() <= 4 ? 1 : 2;
+            Q_FOREACH (const QString &word, document.words) {
+                const int distance = qMin(editDistance(queryWord, word, limit),
+                                          editDistance(queryWord, word.left(queryWord.size()), limit));
+                if (distance <= limit) {
+                    match = qMax(match, 0.6 * (1 - qreal(distance) / (queryWord.size() + 1)));
+                }
+            }
+        }
+    }
+
+    if (match == 0) {
+        return 0;
+    }
+
+    // sortPriority() goes from 0 (available) to 6 (offline)
+    const qreal presence = 1 - document.presenceRank / 6.0;
+    return match * (1 - PresenceWeight) + presence * PresenceWeight;
+}
+
+void ContactSearchIndex::index(int id)
+{
+    Q_FOREACH (quint64 trigram, m_documents.at(id).trigrams) {
+        m_postings[trigram].insert(id);
+    }
+}
+
+void ContactSearchIndex::unindex(int id)
+{
+    Q_FOREACH (quint64 trigram, m_documents.at(id).trigrams) {
+        QHash<quint64, QSet<int> >::iterator it = m_postings.find(trigram);
+        if (it != m_postings.end()) {
+            it.value().remove(id);
+            if (it.value().isEmpty()) {
+                m_postings.erase(it);
+            }
+        }
+    }
+}
@@ -0,0 +1,110 @@
+/*
+ * Trigram index for ranked contact search
+ *
+ * Copyright (C) 2026  KDE Telepathy developers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef KTP_CONTACT_SEARCH_INDEX_PRIVATE_H
+#define KTP_CONTACT_SEARCH_INDEX_PRIVATE_H
+
+#include <QHash>
+#include <QSet>
+#include <QStringList>
+#include <QVector>
+
+#include <TelepathyQt/Constants>
+
+namespace KTp
+{
+
+/**
+ * Maps the words of the searchable fields of a contact (alias, id, account
+ * and group names) to the contacts containing them, by trigram.
+ *
+ * A query only looks at the contacts sharing a trigram with it, or at all of
+ * them for queries of only one or two letter words, and scores them: a field starting with the query ranks above a word starting with it,
+ * above a plain substring, above a fuzzy match of enough trigrams. Online
+ * contacts get a small boost.
+ *
+ * Contacts are keyed by a string identifying them, the same contact can be
+ * added several times (e.g. once per group of a tree model) and only goes
+ * away when it was removed as many times.
+ */
+class ContactSearchIndex
+{
+public:
+    ContactSearchIndex();
+
+    void add(const QString &key, const QStringList &fields, Tp::ConnectionPresenceType presence);
+    void update(const QString &key, const QStringList &fields, Tp::ConnectionPresenceType presence);
+    void remove(const QString &key);
+    void clear();
+
+    bool contains(const QString &key) const;
+    int size() const;
+
+    /**
+     * All the contacts matching @p query with their score, between 0 and 1
+     */
+    QHash<QString, qreal> search(const QString &query) const;
+
+    /**
+     * The score of a single contact for @p query, 0 if it does not match
+     */
+    qreal score(const QString &key, const QString &query) const;
+
+    /**
+     * Strips diacritics and folds the case of @p string
+     */
+    static QString fold(const QString &string);
+
+private:
+    struct Document
+    {
+        QString key;
+        QStringList fields; // folded
+        QStringList words;
+        QVector<quint64> trigrams;
+        int presenceRank;
+        int refs;
+    };
+
+    struct Query
+    {
+        QString text; // folded
+        QStringList words;
+        QVector<quint64> trigrams;
+    };
+
+    static QStringList words(const QString &folded);
+    static QVector<quint64> trigrams(const QStringList &words);
+    static int sharedTrigrams(const QVector<quint64> &a, const QVector<quint64> &b);
+    static int editDistance(const QString &a, const QString &b, int limit);
+    static Query prepare(const QString &query);
+    qreal score(const Document &document, const Query &query, int sharedTrigrams) const;
+    void index(int id);
+    void unindex(int id);
+
+    QVector<Document> m_documents;
+    QVector<int> m_freeIds;
+    QHash<QString, int> m_ids;
+    QHash<quint64, QSet<int> > m_postings;
+};
+
+}
+
+#endif // KTP_CONTACT_SEARCH_INDEX_PRIVATE_H
@@ -23,10 +23,16 @@
 
 #include "contacts-filter-model.h"
 
+#include "contact-search-index-private.h"
 #include "types.h"
 
 #include <presence.h>
 
+#include <QCollator>
+#include <QRegExp>
+
+#include <algorithm>
+
 #include "debug.h"
 
 
@@ -43,7 +49,12 @@ public:
           nicknameFilterMatchFlags(Qt::MatchContains),
           aliasFilterMatchFlags(Qt::MatchContains),
           groupsFilterMatchFlags(Qt::MatchContains),
-          idFilterMatchFlags(Qt::MatchContains)
+          idFilterMatchFlags(Qt::MatchContains),
+          filterGeneration(1),
+          filterChange(FilterChanged),
+          invalidating(false),
+          filterRolesChanged(true),
+          searchMode(SubstringSearch)
     {
     }
 
@@ -69,16 +80,633 @@ public:
     Qt::MatchFlags idFilterMatchFlags;
     Tp::AccountPtr accountFilter;
 
+    // A filter string compiled once per filter change, matched against
+    // precomputed search keys instead of going through match()
+    class Pattern
+    {
+    public:
+        Pattern();
+        void set(const QString &string, Qt::MatchFlags flags);
+        bool isEmpty() const { return string.isEmpty(); }
+        bool matches(const QString &raw, const QString &folded) const;
+        bool matches(const QStringList &raw, const QStringList &folded) const;
+
+    private:
+        QString string;
+        QString needle;
+        uint matchType;
+        Qt::CaseSensitivity cs;
+        QRegExp regExp;
+    };
+
+    // Search keys of a contact row, the folded strings are already stripped
+    // of diacritics and case folded so that matching is a plain comparison
+    struct SearchKeys
+    {
+        QString key;
+        QString displayName;
+        QString foldedDisplayName;
+        QString id;
+        QString foldedId;
+        QStringList groups;
+        QStringList foldedGroups;
+
+        // the last filter result and the filterGeneration it was computed in
+        uint generation;
+        bool accepted;
+
+        SearchKeys() : generation(0), accepted(false) { }
+    };
+
+    // What lessThan() compares, built when the name or presence of a row
+    // changes rather than collating the names on every comparison
+    struct SortKey
+    {
+        SortKey(const QCollatorSortKey &name, int presenceRank, bool phone)
+            : name(name), presenceRank(presenceRank), phone(phone) { }
+
+        QCollatorSortKey name;
+        int presenceRank;
+        bool phone;
+    };
+
+    // The per row caches a change of the source model can make stale
+    enum RowCache {
+        SearchKeysCache = 0x1,
+        SortKeysCache = 0x2,
+        AllRowCaches = SearchKeysCache | SortKeysCache
+    };
+
+    // How a filter string changed compared to the previous one
+    enum FilterChange {
+        FilterChanged,
+        FilterNarrowed, ///< can only hide rows which are shown now
+        FilterWidened   ///< can only show rows which are hidden now
+    };
+
+    Pattern globalPattern;
+    Pattern displayNamePattern;
+    Pattern groupsPattern;
+    Pattern idPattern;
+
+    // keyed by rowKey(), kept up to date from the source model signals
+    mutable QHash<QString, SearchKeys> searchKeys;
+    QList<QMetaObject::Connection> searchKeysConnections;
+
+    QCollator collator;
+    // keyed by rowKey() too
+    mutable QHash<QString, SortKey> sortKeys;
+
+    uint filterGeneration;
+    FilterChange filterChange;
+    bool invalidating;
+    // false while the source model reports a change of roles no filter looks at
+    bool filterRolesChanged;
+
+    // How a change of the source rows is applied to the search index
+    enum IndexChange {
+        IndexAdd,
+        IndexUpdate,
+        IndexRemove
+    };
+
+    SearchMode searchMode;
+    ContactSearchIndex searchIndex;
+    // the global filter string fuzzyScores were computed for
+    QString fuzzyQuery;
+    QHash<QString, qreal> fuzzyScores;
+
+    void rebuildSearchIndex(QAbstractItemModel *sourceModel);
+    void updateSearchIndex(QAbstractItemModel *sourceModel, const QModelIndex &parent, int first, int last, IndexChange update);
+    void updateFuzzyScores();
+    qreal searchScore(const QModelIndex &index) const;
+    void invalidateFilterAndSort();
+    void refineFuzzySearch(FilterChange change);
+    static FilterChange compareScoredRows(const QHash<QString, qreal> &from, const QHash<QString, qreal> &to);
+    static bool scoreOrderChanged(const QHash<QString, qreal> &from, const QHash<QString, qreal> &to);
+
+    static QString rowKey(const QModelIndex &index);
+    SearchKeys computeSearchKeys(const QModelIndex &index) const;
+    SearchKeys &searchKeysFor(const QModelIndex &index, SearchKeys &uncached) const;
+    SortKey computeSortKey(const QModelIndex &index) const;
+    SortKey sortKeyFor(const QModelIndex &index) const;
+    void updatePatterns();
+    static FilterChange compareFilterStrings(const QString &from, const QString &to, Qt::MatchFlags flags);
+    void invalidateFilter(FilterChange change);
+    bool affectsFilter(const QVector<int> &roles) const;
+    void invalidateRowCaches(const QModelIndex &parent, int first, int last, int caches);
+    void connectSearchKeys(QAbstractItemModel *sourceModel);
+    void connectFilterRolesReset(QAbstractItemModel *sourceModel);
+    void disconnectSearchKeys();
+
     bool filterAcceptsAccount(const QModelIndex &index) const;
     bool filterAcceptsContact(const QModelIndex &index) const;
+    bool testContact(const QModelIndex &index, const SearchKeys &keys) const;
     bool filterAcceptsGroup(const QModelIndex &index);
 
-    void sourceModelParentIndexChanged(const QModelIndex &sourceIndex);
-    void sourceModelIndexChanged(const QModelIndex &sourceIndex);
+    static bool isHeading(const QModelIndex &index);
+    QHash<QModelIndex, int> headingCounts() const;
+    void headerCountChanged(const QModelIndex &heading);
+
 };
 
 using namespace KTp;
 
+ContactsFilterModel::Private::Pattern::Pattern()
+    : matchType(Qt::MatchContains),
+      cs(Qt::CaseInsensitive)
+{
+}
+
+void ContactsFilterModel::Private::Pattern::set(const QString &string, Qt::MatchFlags flags)
+{
+    this->string = string;
+    matchType = flags & 0x0F;
+    cs = flags & Qt::MatchCaseSensitive ? Qt::CaseSensitive : Qt::CaseInsensitive;
+    needle = cs == Qt::CaseInsensitive ? ContactSearchIndex::fold(string) : string;
+
+    if (matchType == Qt::MatchRegExp) {
+        regExp = QRegExp(string, cs);
+    } else if (matchType == Qt::MatchWildcard) {
+        regExp = QRegExp(string, cs, QRegExp::Wildcard);
+    } else {
+        regExp = QRegExp();
+    }
+}
+
+bool ContactsFilterModel::Private::Pattern::matches(const QString &raw, const QString &folded) const
+{
+    if (matchType == Qt::MatchExactly) {
+        return raw == string;
+    }
+
+    const QString &t = cs == Qt::CaseInsensitive ? folded : raw;
+
+    switch (matchType) {
+    case Qt::MatchRegExp:
+    case Qt::MatchWildcard:
+        return regExp.exactMatch(t);
+    case Qt::MatchStartsWith:
+        return t.startsWith(needle);
+    case Qt::MatchEndsWith:
+        return t.endsWith(needle);
+    case Qt::MatchFixedString:
+        return t == needle;
+    case Qt::MatchContains:
+    default:
+        return t.contains(needle);
+    }
+}
+
+bool ContactsFilterModel::Private::Pattern::matches(const QStringList &raw, const QStringList &folded) const
+{
+    for (int i = 0; i < raw.size(); ++i) {
+        if (matches(raw.at(i), folded.at(i))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+QString ContactsFilterModel::Private::rowKey(const QModelIndex &index)
+{
+    // The same contact can show up in several groups of a tree model, all
+    // of its rows share the same keys
+    const QString id = index.data(KTp::IdRole).toString();
+    if (id.isEmpty()) {
+        return QString();
+    }
+
+    const Tp::AccountPtr account = index.data(KTp::AccountRole).value<Tp::AccountPtr>();
+    if (account) {
+        return account->uniqueIdentifier() + QLatin1Char('/') + id;
+    }
+    return id;
+}
+
+ContactsFilterModel::Private::SearchKeys ContactsFilterModel::Private::computeSearchKeys(const QModelIndex &index) const
+{
+    SearchKeys keys;
+    keys.displayName = index.data(Qt::DisplayRole).toString();
+    keys.foldedDisplayName = ContactSearchIndex::fold(keys.displayName);
+    keys.id = index.data(KTp::IdRole).toString();
+    keys.foldedId = ContactSearchIndex::fold(keys.id);
+    keys.groups = index.data(KTp::ContactGroupsRole).toStringList();
+    Q_FOREACH (const QString &group, keys.groups) {
+        keys.foldedGroups.append(ContactSearchIndex::fold(group));
+    }
+    return keys;
+}
+
+ContactsFilterModel::Private::SearchKeys &ContactsFilterModel::Private::searchKeysFor(const QModelIndex &index, SearchKeys &uncached) const
+{
+    const QString key = rowKey(index);
+    if (key.isEmpty()) {
+        uncached = computeSearchKeys(index);
+        return uncached;
+    }
+
+    QHash<QString, SearchKeys>::iterator it = searchKeys.find(key);
+    if (it == searchKeys.end()) {
+        it = searchKeys.insert(key, computeSearchKeys(index));
+        it.value().key = key;
+    }
+    return it.value();
+}
+
+ContactsFilterModel::Private::SortKey ContactsFilterModel::Private::computeSortKey(const QModelIndex &index) const
+{
+    const Tp::ConnectionPresenceType presence = static_cast<Tp::ConnectionPresenceType>(index.data(KTp::ContactPresenceTypeRole).toUInt());
+
+    // offline, unknown and the like all sort last, and the same
+    int presenceRank;
+    switch (presence) {
+    case Tp::ConnectionPresenceTypeUnset:
+    case Tp::ConnectionPresenceTypeOffline:
+    case Tp::ConnectionPresenceTypeUnknown:
+    case Tp::ConnectionPresenceTypeError:
+        presenceRank = KTp::Presence::sortPriority(Tp::ConnectionPresenceTypeOffline);
+        break;
+    default:
+        presenceRank = KTp::Presence::sortPriority(presence);
+        break;
+    }
+
+    return SortKey(collator.sortKey(index.data(Qt::DisplayRole).toString()),
+                   presenceRank,
+                   index.data(KTp::ContactClientTypesRole).toStringList().contains(QLatin1String("phone")));
+}
+
+ContactsFilterModel::Private::SortKey ContactsFilterModel::Private::sortKeyFor(const QModelIndex &index) const
+{
+    const QString key = rowKey(index);
+    if (key.isEmpty()) {
+        return computeSortKey(index);
+    }
+
+    QHash<QString, SortKey>::const_iterator it = sortKeys.constFind(key);
+    if (it == sortKeys.constEnd()) {
+        it = sortKeys.insert(key, computeSortKey(index));
+    }
+    return it.value();
+}
+
+void ContactsFilterModel::Private::updatePatterns()
+{
+    globalPattern.set(globalFilterString, globalFilterMatchFlags);
+    displayNamePattern.set(displayNameFilterString, displayNameFilterMatchFlags);
+    groupsPattern.set(groupsFilterString, groupsFilterMatchFlags);
+    idPattern.set(idFilterString, idFilterMatchFlags);
+    updateFuzzyScores();
+}
+
+void ContactsFilterModel::Private::rebuildSearchIndex(QAbstractItemModel *sourceModel)
+{
+    searchIndex.clear();
+    fuzzyScores.clear();
+    fuzzyQuery.clear();
+
+    if (searchMode == FuzzySearch && sourceModel && sourceModel->rowCount() > 0) {
+        updateSearchIndex(sourceModel, QModelIndex(), 0, sourceModel->rowCount() - 1, IndexAdd);
+    }
+}
+
+void ContactsFilterModel::Private::updateSearchIndex(QAbstractItemModel *sourceModel, const QModelIndex &parent, int first, int last, IndexChange update)
+{
+    for (int row = first; row <= last; ++row) {
+        const QModelIndex index = sourceModel->index(row, 0, parent);
+        const int type = index.data(KTp::RowTypeRole).toInt();
+
+        const QString key = type == KTp::ContactRowType || type == KTp::PersonRowType ? rowKey(index) : QString();
+        if (!key.isEmpty()) {
+            if (update == IndexRemove) {
+                searchIndex.remove(key);
+            } else {
+                QStringList fields;
+                fields << index.data(Qt::DisplayRole).toString()
+                       << index.data(KTp::IdRole).toString();
+                const Tp::AccountPtr account = index.data(KTp::AccountRole).value<Tp::AccountPtr>();
+                if (account) {
+                    fields << account->displayName();
+                }
+                fields << index.data(KTp::ContactGroupsRole).toStringList();
+
+                const Tp::ConnectionPresenceType presence = static_cast<Tp::ConnectionPresenceType>(index.data(KTp::ContactPresenceTypeRole).toUInt());
+                if (update == IndexAdd) {
+                    searchIndex.add(key, fields, presence);
+                } else {
+                    searchIndex.update(key, fields, presence);
+                }
+            }
+
+            if (!fuzzyQuery.isEmpty()) {
+                const qreal score = searchIndex.score(key, fuzzyQuery);
+                if (score > 0) {
+                    fuzzyScores.insert(key, score);
+                } else {
+                    fuzzyScores.remove(key);
+                }
+            }
+        }
+
+        // groups and metacontacts, updates come for each row on its own
+        if (update != IndexUpdate) {
+            const int children = sourceModel->rowCount(index);
+            if (children > 0) {
+                updateSearchIndex(sourceModel, index, 0, children - 1, update);
+            }
+        }
+    }
+}
+
+void ContactsFilterModel::Private::updateFuzzyScores()
+{
+    if (searchMode != FuzzySearch) {
+        fuzzyQuery.clear();
+        fuzzyScores.clear();
+    } else if (fuzzyQuery != globalFilterString) {
+        fuzzyQuery = globalFilterString;
+        fuzzyScores = searchIndex.search(fuzzyQuery);
+    }
+}
+
+qreal ContactsFilterModel::Private::searchScore(const QModelIndex &index) const
+{
+    if (fuzzyScores.isEmpty()) {
+        return 0;
+    }
+    return fuzzyScores.value(rowKey(index));
+}
+
+void ContactsFilterModel::Private::invalidateFilterAndSort()
+{
+    // the order depends on the scores, so sort again as well
+    updatePatterns();
+    ++filterGeneration;
+    const QHash<QModelIndex, int> counts = headingCounts();
+    invalidating = true;
+    q->invalidate();
+    invalidating = false;
+
+    // rebuilding the mapping reports no rows coming or going, only a new layout
+    for (int row = 0; row < q->rowCount(); ++row) {
+        const QModelIndex index = q->index(row, 0);
+        if (!isHeading(index)) {
+            break;
+        }
+        const QHash<QModelIndex, int>::ConstIterator count = counts.constFind(q->mapToSource(index));
+        if (count != counts.constEnd() && count.value() != q->rowCount(index)) {
+            headerCountChanged(index);
+        }
+    }
+}
+
+void ContactsFilterModel::Private::refineFuzzySearch(FilterChange change)
+{
+    const QHash<QString, qreal> previous = fuzzyScores;
+    updateFuzzyScores();
+
+    // a fuzzy search shows the scored rows, however the query itself changed
+    if (change != FilterChanged) {
+        change = compareScoredRows(previous, fuzzyScores);
+    }
+    invalidateFilter(change);
+
+    // rows coming in are sorted in by their score already, the others only need
+    // sorting again when their scores no longer rank them the same way
+    if (change == FilterChanged || scoreOrderChanged(previous, fuzzyScores)) {
+        // every filter result of this generation is cached, so this only sorts
+        invalidating = true;
+        q->invalidate();
+        invalidating = false;
+    }
+}
+
+ContactsFilterModel::Private::FilterChange ContactsFilterModel::Private::compareScoredRows(const QHash<QString, qreal> &from, const QHash<QString, qreal> &to)
+{
+    bool narrowed = true;
+    for (QHash<QString, qreal>::ConstIterator it = to.constBegin(); narrowed && it != to.constEnd(); ++it) {
+        narrowed = from.contains(it.key());
+    }
+    if (narrowed) {
+        return FilterNarrowed;
+    }
+
+    bool widened = true;
+    for (QHash<QString, qreal>::ConstIterator it = from.constBegin(); widened && it != from.constEnd(); ++it) {
+        widened = to.contains(it.key());
+    }
+    return widened ? FilterWidened : FilterChanged;
+}
+
+bool ContactsFilterModel::Private::scoreOrderChanged(const QHash<QString, qreal> &from, const QHash<QString, qreal> &to)
+{
+    // (previous score, new score) of the rows scored both times
+    QVector<QPair<qreal, qreal> > kept;
+    for (QHash<QString, qreal>::ConstIterator it = to.constBegin(); it != to.constEnd(); ++it) {
+        const QHash<QString, qreal>::ConstIterator previous = from.constFind(it.key());
+        if (previous != from.constEnd()) {
+            kept << qMakePair(previous.value(), it.value());
+        }
+    }
+
+    std::sort(kept.begin(), kept.end(), [](const QPair<qreal, qreal> &left, const QPair<qreal, qreal> &right) {
+        return left.first > right.first;
+    });
+
+    // ranked the same if each pair of neighbours compares the same way both times
+    for (int i = 1; i < kept.size(); ++i) {
+        const bool wasEqual = kept.at(i - 1).first == kept.at(i).first;
+        const bool isEqual = kept.at(i - 1).second == kept.at(i).second;
+        if (wasEqual != isEqual || (!isEqual && kept.at(i - 1).second < kept.at(i).second)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ContactsFilterModel::Private::FilterChange ContactsFilterModel::Private::compareFilterStrings(const QString &from, const QString &to, Qt::MatchFlags flags)
+{
+    const bool caseInsensitive = !(flags & Qt::MatchCaseSensitive);
+    const QString f = caseInsensitive ? ContactSearchIndex::fold(from) : from;
+    const QString t = caseInsensitive ? ContactSearchIndex::fold(to) : to;
+
+    switch (flags & 0x0F) {
+    case Qt::MatchContains:
+        if (t.contains(f)) {
+            return FilterNarrowed;
+        } else if (f.contains(t)) {
+            return FilterWidened;
+        }
+        break;
+    case Qt::MatchStartsWith:
+        if (t.startsWith(f)) {
+            return FilterNarrowed;
+        } else if (f.startsWith(t)) {
+            return FilterWidened;
+        }
+        break;
+    case Qt::MatchEndsWith:
+        if (t.endsWith(f)) {
+            return FilterNarrowed;
+        } else if (f.endsWith(t)) {
+            return FilterWidened;
+        }
+        break;
+    default:
+        break;
+    }
+
+    return FilterChanged;
+}
+
+void ContactsFilterModel::Private::invalidateFilter(FilterChange change)
+{
+    filterChange = change;
+    q->invalidateFilter();
+    filterChange = FilterChanged;
+}
+
+bool ContactsFilterModel::Private::affectsFilter(const QVector<int> &roles) const
+{
+    QVector<int> filterRoles;
+    filterRoles << KTp::RowTypeRole;
+    if (presenceTypeFilterFlags != DoNotFilterByPresence) {
+        filterRoles << KTp::ContactPresenceTypeRole;
+    }
+    if (capabilityFilterFlags != DoNotFilterByCapability) {
+        filterRoles << KTp::ContactCanTextChatRole
+                    << KTp::ContactCanAudioCallRole
+                    << KTp::ContactCanVideoCallRole
+                    << KTp::ContactCanFileTransferRole
+                    << KTp::ContactTubesRole;
+    }
+    if (subscriptionStateFilterFlags != DoNotFilterBySubscription) {
+        filterRoles << KTp::ContactSubscriptionStateRole
+                    << KTp::ContactPublishStateRole
+                    << KTp::ContactIsBlockedRole;
+    }
+    if (!globalPattern.isEmpty() || !displayNamePattern.isEmpty() || !groupsPattern.isEmpty() || !idPattern.isEmpty()) {
+        filterRoles << Qt::DisplayRole
+                    << KTp::IdRole
+                    << KTp::ContactGroupsRole;
+    }
+    if (accountFilter || searchMode == FuzzySearch) {
+        filterRoles << KTp::AccountRole;
+    }
+
+    Q_FOREACH (int role, roles) {
+        if (filterRoles.contains(role)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ContactsFilterModel::Private::invalidateRowCaches(const QModelIndex &parent, int first, int last, int caches)
+{
+    if (searchKeys.isEmpty()) {
+        caches &= ~SearchKeysCache;
+    }
+    if (sortKeys.isEmpty()) {
+        caches &= ~SortKeysCache;
+    }
+    if (!caches) {
+        return;
+    }
+
+    const QAbstractItemModel *model = q->sourceModel();
+    for (int row = first; row <= last; ++row) {
+        const QModelIndex index = model->index(row, 0, parent);
+        const QString key = rowKey(index);
+        if (!key.isEmpty()) {
+            if (caches & SearchKeysCache) {
+                searchKeys.remove(key);
+            }
+            if (caches & SortKeysCache) {
+                sortKeys.remove(key);
+            }
+        }
+        const int children = model->rowCount(index);
+        if (children > 0) {
+            invalidateRowCaches(index, 0, children - 1, caches);
+        }
+    }
+}
+
+void ContactsFilterModel::Private::connectSearchKeys(QAbstractItemModel *sourceModel)
+{
+    // These have to run before QSortFilterProxyModel filters the changed
+    // rows, so they are connected before the source model is set
+    searchKeysConnections << QObject::connect(sourceModel, &QAbstractItemModel::dataChanged, q,
+        [=](const QModelIndex &topLeft, const QModelIndex &bottomRight, const QVector<int> &roles) {
+            filterRolesChanged = roles.isEmpty() || affectsFilter(roles);
+            int caches = 0;
+            if (roles.isEmpty()
+                    || roles.contains(Qt::DisplayRole)
+                    || roles.contains(KTp::IdRole)
+                    || roles.contains(KTp::ContactGroupsRole)) {
+                caches |= SearchKeysCache;
+            }
+            if (roles.isEmpty()
+                    || roles.contains(Qt::DisplayRole)
+                    || roles.contains(KTp::ContactPresenceTypeRole)
+                    || roles.contains(KTp::ContactClientTypesRole)) {
+                caches |= SortKeysCache;
+            }
+            invalidateRowCaches(topLeft.parent(), topLeft.row(), bottomRight.row(), caches);
+            if (searchMode == FuzzySearch
+                    && (roles.isEmpty()
+                        || roles.contains(Qt::DisplayRole)
+                        || roles.contains(KTp::IdRole)
+                        || roles.contains(KTp::ContactGroupsRole)
+                        || roles.contains(KTp::ContactPresenceTypeRole))) {
+                updateSearchIndex(q->sourceModel(), topLeft.parent(), topLeft.row(), bottomRight.row(), IndexUpdate);
+            }
+        });
+    searchKeysConnections << QObject::connect(sourceModel, &QAbstractItemModel::rowsInserted, q,
+        [=](const QModelIndex &parent, int first, int last) {
+            invalidateRowCaches(parent, first, last, AllRowCaches);
+            if (searchMode == FuzzySearch) {
+                updateSearchIndex(q->sourceModel(), parent, first, last, IndexAdd);
+            }
+        });
+    searchKeysConnections << QObject::connect(sourceModel, &QAbstractItemModel::rowsAboutToBeRemoved, q,
+        [=](const QModelIndex &parent, int first, int last) {
+            invalidateRowCaches(parent, first, last, AllRowCaches);
+            if (searchMode == FuzzySearch) {
+                updateSearchIndex(q->sourceModel(), parent, first, last, IndexRemove);
+            }
+        });
+    searchKeysConnections << QObject::connect(sourceModel, &QAbstractItemModel::modelReset, q,
+        [=]() {
+            searchKeys.clear();
+            sortKeys.clear();
+            rebuildSearchIndex(q->sourceModel());
+            updateFuzzyScores();
+        });
+}
+
+void ContactsFilterModel::Private::connectFilterRolesReset(QAbstractItemModel *sourceModel)
+{
+    // runs after QSortFilterProxyModel has filtered the changed rows
+    searchKeysConnections << QObject::connect(sourceModel, &QAbstractItemModel::dataChanged, q,
+        [=]() {
+            filterRolesChanged = true;
+        });
+}
+
+void ContactsFilterModel::Private::disconnectSearchKeys()
+{
+    Q_FOREACH (const QMetaObject::Connection &connection, searchKeysConnections) {
+        QObject::disconnect(connection);
+    }
+    searchKeysConnections.clear();
+    searchKeys.clear();
+    sortKeys.clear();
+    rebuildSearchIndex(nullptr);
+}
+
 bool ContactsFilterModel::Private::filterAcceptsAccount(const QModelIndex &index) const
 {
     // Check capability
@@ -114,10 +742,6 @@ bool ContactsFilterModel::Private::filterAcceptsAccount(const QModelIndex &index
 
 bool ContactsFilterModel::Private::filterAcceptsContact(const QModelIndex &index) const
 {
-    // Presence type, capability and subscription state are always checked
-    // Then if global filter is set we can return true if a result is found for
-    // any of the strings, otherwise we check all of them
-
     Q_ASSERT(index.isValid());
     if (!index.isValid()) {
         return false;
@@ -128,6 +752,40 @@ bool ContactsFilterModel::Private::filterAcceptsContact(const QModelIndex &index
         return true;
     }
 
+    if (globalPattern.isEmpty() && displayNamePattern.isEmpty() && groupsPattern.isEmpty() && idPattern.isEmpty()) {
+        return testContact(index, SearchKeys());
+    }
+
+    SearchKeys uncached;
+    SearchKeys &keys = searchKeysFor(index, uncached);
+
+    if (keys.generation != 0) {
+        // a contact listed in several groups is only tested once per pass,
+        // and not at all when only roles no filter looks at changed
+        if ((invalidating || !filterRolesChanged) && keys.generation == filterGeneration) {
+            return keys.accepted;
+        }
+
+        // while typing, only the rows the new filter string can change are tested again
+        if (keys.generation == filterGeneration - 1
+                && ((filterChange == FilterNarrowed && !keys.accepted)
+                    || (filterChange == FilterWidened && keys.accepted))) {
+            keys.generation = filterGeneration;
+            return keys.accepted;
+        }
+    }
+
+    keys.accepted = testContact(index, keys);
+    keys.generation = filterGeneration;
+    return keys.accepted;
+}
+
+bool ContactsFilterModel::Private::testContact(const QModelIndex &index, const SearchKeys &keys) const
+{
+    // Presence type, capability and subscription state are always checked
+    // Then if global filter is set we can return true if a result is found for
+    // any of the strings, otherwise we check all of them
+
     // Check presence type
     if (presenceTypeFilterFlags != DoNotFilterByPresence) {
         switch (static_cast<Tp::ConnectionPresenceType>(index.data(KTp::ContactPresenceTypeRole).toUInt())) {
@@ -275,45 +933,46 @@ bool ContactsFilterModel::Private::filterAcceptsContact(const QModelIndex &index
         }
     }
 
-    if (!globalFilterString.isEmpty()) {
+    if (!globalPattern.isEmpty() && searchMode == FuzzySearch) {
+        return fuzzyScores.contains(keys.key);
+    } else if (!globalPattern.isEmpty()) {
         // Check global filter (search on all the roles)
 
         // Check display name
-        if (!q->match(index, Qt::DisplayRole, globalFilterString, 1, globalFilterMatchFlags).isEmpty()) {
+        if (globalPattern.matches(keys.displayName, keys.foldedDisplayName)) {
             return true;
         }
 
         // check groups
-        // TODO Check if exact match on a single group works
-        if (!q->match(index, KTp::ContactGroupsRole, globalFilterString, 1, globalFilterMatchFlags).isEmpty()) {
+        if (globalPattern.matches(keys.groups, keys.foldedGroups)) {
             return true;
         }
 
         // Check id
-        if (!q->match(index, KTp::IdRole, globalFilterString, 1, globalFilterMatchFlags).isEmpty()) {
+        if (globalPattern.matches(keys.id, keys.foldedId)) {
             return true;
         }
 
         return false;
-    } else {
+    } else if (!displayNamePattern.isEmpty() || !groupsPattern.isEmpty() || !idPattern.isEmpty()) {
         // Check on single filters
+
         // Check display name
-        if (!displayNameFilterString.isEmpty()) {
-            if (q->match(index, Qt::DisplayRole, displayNameFilterString, 1, displayNameFilterMatchFlags).isEmpty()) {
+        if (!displayNamePattern.isEmpty()) {
+            if (!displayNamePattern.matches(keys.displayName, keys.foldedDisplayName)) {
                 return false;
             }
         }
         // check groups
-        // TODO Check if exact match on a single group works
-        if (!groupsFilterString.isEmpty()) {
-            if (q->match(index, KTp::ContactGroupsRole, groupsFilterString, 1, groupsFilterMatchFlags).isEmpty()) {
+        if (!groupsPattern.isEmpty()) {
+            if (!groupsPattern.matches(keys.groups, keys.foldedGroups)) {
                 return false;
             }
         }
 
         // Check id
-        if (!idFilterString.isEmpty()) {
-            if (q->match(index, KTp::IdRole, idFilterString, 1, idFilterMatchFlags).isEmpty()) {
+        if (!idPattern.isEmpty()) {
+            if (!idPattern.matches(keys.id, keys.foldedId)) {
                 return false;
             }
         }
@@ -334,30 +993,54 @@ bool ContactsFilterModel::Private::filterAcceptsGroup(const QModelIndex &/*index
     return true;
 }
 
-void ContactsFilterModel::Private::sourceModelParentIndexChanged(const QModelIndex &sourceIndex)
+bool ContactsFilterModel::Private::isHeading(const QModelIndex &index)
 {
-    //if parent is a group heading
-    if (sourceIndex.isValid() &&
-        (sourceIndex.data(KTp::RowTypeRole).toInt() == KTp::GroupRowType ||
-        sourceIndex.data(KTp::RowTypeRole).toInt() == KTp::AccountRowType)) {
-
+    const int type = index.data(KTp::RowTypeRole).toInt();
+    return type == KTp::GroupRowType || type == KTp::AccountRowType;
+}
 
-        q->dataChanged(q->mapFromSource(sourceIndex), q->mapFromSource(sourceIndex));
+QHash<QModelIndex, int> ContactsFilterModel::Private::headingCounts() const
+{
+    // headings are all at the top level, a flat list starts with a contact right away
+    QHash<QModelIndex, int> counts;
+    for (int row = 0; row < q->rowCount(); ++row) {
+        const QModelIndex index = q->index(row, 0);
+        if (!isHeading(index)) {
+            break;
+        }
+        counts.insert(q->mapToSource(index), q->rowCount(index));
     }
+    return counts;
 }
 
-void ContactsFilterModel::Private::sourceModelIndexChanged(const QModelIndex &sourceIndex)
+void ContactsFilterModel::Private::headerCountChanged(const QModelIndex &heading)
 {
-    sourceModelParentIndexChanged(sourceIndex.parent());
+    if (heading.isValid() && isHeading(heading)) {
+        Q_EMIT q->dataChanged(heading, heading, QVector<int>() << KTp::HeaderOnlineUsersRole);
+    }
 }
 
-
 ContactsFilterModel::ContactsFilterModel(QObject *parent)
     : QSortFilterProxyModel(parent),
       d(new Private(this))
 {
+    d->updatePatterns();
     sort(0); //sort always
     setDynamicSortFilter(true);
+
+    // the online count of a heading is the number of its rows which pass the filters
+    connect(this, &QAbstractItemModel::rowsInserted, this, [this](const QModelIndex &parent) {
+        d->headerCountChanged(parent);
+    });
+    connect(this, &QAbstractItemModel::rowsRemoved, this, [this](const QModelIndex &parent) {
+        d->headerCountChanged(parent);
+    });
+    connect(this, &QAbstractItemModel::rowsMoved, this, [this](const QModelIndex &sourceParent, int, int, const QModelIndex &destinationParent) {
+        if (sourceParent != destinationParent) {
+            d->headerCountChanged(sourceParent);
+            d->headerCountChanged(destinationParent);
+        }
+    });
 }
 
 ContactsFilterModel::~ContactsFilterModel()
@@ -379,7 +1062,17 @@ QVariant ContactsFilterModel::data(const QModelIndex &index, int role) const
     if (role == KTp::HeaderOnlineUsersRole) {
         return rowCount(index);
     } else if (role == KTp::HeaderTotalUsersRole) {
+        // grouping proxies keep count of their members, and tell when the count changes
+        const QVariant count = sourceModel()->data(sourceIndex, role);
+        if (count.isValid()) {
+            return count;
+        }
         return sourceModel()->rowCount(sourceIndex);
+    } else if (role == KTp::ContactSearchScoreRole) {
+        if (d->fuzzyQuery.isEmpty()) {
+            return QVariant();
+        }
+        return d->searchScore(sourceIndex);
     }
 
     // In all other cases just delegate it to the source model
@@ -390,34 +1083,25 @@ void ContactsFilterModel::setSourceModel(QAbstractItemModel *sourceModel)
 {
     // Disconnect the previous source model
     if (this->sourceModel()) {
-        disconnect(this->sourceModel(), SIGNAL(dataChanged(QModelIndex,QModelIndex)),
-                this, SLOT(sourceModelIndexChanged(QModelIndex)));
-        disconnect(this->sourceModel(), SIGNAL(rowsInserted(QModelIndex,int,int)),
-                this, SLOT(sourceModelParentIndexChanged(QModelIndex)));
-        disconnect(this->sourceModel(), SIGNAL(rowsRemoved(QModelIndex,int,int)),
-                this, SLOT(sourceModelParentIndexChanged(QModelIndex)));
-        disconnect(this->sourceModel(), SIGNAL(rowsMoved(QModelIndex,int,int,QModelIndex,int)),
-                this, SLOT(sourceModelParentIndexChanged(QModelIndex)));
+        d->disconnectSearchKeys();
     }
 
     if (sourceModel) {
+        d->connectSearchKeys(sourceModel);
+        d->rebuildSearchIndex(sourceModel);
+        d->updateFuzzyScores();
         QSortFilterProxyModel::setSourceModel(sourceModel);
-
-        // Connect the new source model
-        connect(this->sourceModel(), SIGNAL(dataChanged(QModelIndex,QModelIndex)),
-                this, SLOT(sourceModelIndexChanged(QModelIndex)));
-        connect(this->sourceModel(), SIGNAL(rowsInserted(QModelIndex,int,int)),
-                this, SLOT(sourceModelParentIndexChanged(QModelIndex)));
-        connect(this->sourceModel(), SIGNAL(rowsRemoved(QModelIndex,int,int)),
-                this, SLOT(sourceModelParentIndexChanged(QModelIndex)));
-        connect(this->sourceModel(), SIGNAL(rowsMoved(QModelIndex,int,int,QModelIndex,int)),
-                this, SLOT(sourceModelParentIndexChanged(QModelIndex)));
+        d->connectFilterRolesReset(sourceModel);
     }
 }
 
 void ContactsFilterModel::invalidateFilter()
 {
+    d->updatePatterns();
+    ++d->filterGeneration;
+    d->invalidating = true;
     QSortFilterProxyModel::invalidateFilter();
+    d->invalidating = false;
 }
 
 ContactsFilterModel::PresenceTypeFilterFlags ContactsFilterModel::presenceTypeFilterFlags() const
@@ -490,12 +1174,37 @@ void ContactsFilterModel::clearGlobalFilterString()
 void ContactsFilterModel::setGlobalFilterString(const QString &globalFilterString)
 {
     if (d->globalFilterString != globalFilterString) {
+        // the single filters and the account filter only apply without a
+        // global filter, so setting or clearing it is not a refinement
+        Private::FilterChange change = Private::FilterChanged;
+        if (!d->globalFilterString.isEmpty() && !globalFilterString.isEmpty()) {
+            change = Private::compareFilterStrings(d->globalFilterString, globalFilterString, d->globalFilterMatchFlags);
+        }
         d->globalFilterString = globalFilterString;
-        invalidateFilter();
+        if (d->searchMode == FuzzySearch) {
+            d->refineFuzzySearch(change);
+        } else {
+            d->invalidateFilter(change);
+        }
         Q_EMIT globalFilterStringChanged(globalFilterString);
     }
 }
 
+ContactsFilterModel::SearchMode ContactsFilterModel::searchMode() const
+{
+    return d->searchMode;
+}
+
+void ContactsFilterModel::setSearchMode(ContactsFilterModel::SearchMode searchMode)
+{
+    if (d->searchMode != searchMode) {
+        d->searchMode = searchMode;
+        d->rebuildSearchIndex(sourceModel());
+        d->invalidateFilterAndSort();
+        Q_EMIT searchModeChanged(searchMode);
+    }
+}
+
 Qt::MatchFlags ContactsFilterModel::globalFilterMatchFlags() const
 {
     return d->globalFilterMatchFlags;
@@ -528,8 +1237,9 @@ void ContactsFilterModel::clearDisplayNameFilterString()
 void ContactsFilterModel::setDisplayNameFilterString(const QString &displayNameFilterString)
 {
     if (d->displayNameFilterString != displayNameFilterString) {
+        const Private::FilterChange change = Private::compareFilterStrings(d->displayNameFilterString, displayNameFilterString, d->displayNameFilterMatchFlags);
         d->displayNameFilterString = displayNameFilterString;
-        invalidateFilter();
+        d->invalidateFilter(change);
         Q_EMIT displayNameFilterStringChanged(displayNameFilterString);
     }
 }
@@ -642,8 +1352,9 @@ void ContactsFilterModel::clearGroupsFilterString()
 void ContactsFilterModel::setGroupsFilterString(const QString &groupsFilterString)
 {
     if (d->groupsFilterString != groupsFilterString) {
+        const Private::FilterChange change = Private::compareFilterStrings(d->groupsFilterString, groupsFilterString, d->groupsFilterMatchFlags);
         d->groupsFilterString = groupsFilterString;
-        invalidateFilter();
+        d->invalidateFilter(change);
         Q_EMIT groupsFilterStringChanged(groupsFilterString);
     }
 }
@@ -680,8 +1391,9 @@ void ContactsFilterModel::clearIdFilterString()
 void ContactsFilterModel::setIdFilterString(const QString &idFilterString)
 {
     if (d->idFilterString != idFilterString) {
+        const Private::FilterChange change = Private::compareFilterStrings(d->idFilterString, idFilterString, d->idFilterMatchFlags);
         d->idFilterString = idFilterString;
-        invalidateFilter();
+        d->invalidateFilter(change);
         Q_EMIT idFilterStringChanged(idFilterString);
     }
 }
@@ -769,48 +1481,30 @@ bool ContactsFilterModel::filterAcceptsRow(int sourceRow, const QModelIndex &sou
 
 bool ContactsFilterModel::lessThan(const QModelIndex &left, const QModelIndex &right) const
 {
+    // best matches of a fuzzy search first
+    if (!d->fuzzyScores.isEmpty()) {
+        const qreal leftScore = d->searchScore(left);
+        const qreal rightScore = d->searchScore(right);
+        if (leftScore != rightScore) {
+            return leftScore > rightScore;
+        }
+    }
 
-    QString leftDisplayedName = sourceModel()->data(left).toString();
-    QString rightDisplayedName = sourceModel()->data(right).toString();
-
-    switch (sortRole()) {
-        case KTp::ContactPresenceTypeRole:
-    {
-        Tp::ConnectionPresenceType leftPresence = (Tp::ConnectionPresenceType)left.data(KTp::ContactPresenceTypeRole).toUInt();
-        Tp::ConnectionPresenceType rightPresence = (Tp::ConnectionPresenceType)right.data(KTp::ContactPresenceTypeRole).toUInt();
-
-        if (leftPresence == rightPresence) {
-            //presences are the same, compare client types
-
-            bool leftPhone = left.data(KTp::ContactClientTypesRole).toStringList().contains(QLatin1String("phone"));
-            bool rightPhone = right.data(KTp::ContactClientTypesRole).toStringList().contains(QLatin1String("phone"));
-
-            if (leftPhone && ! rightPhone) {
-                return false;
-            }
-            else if (rightPhone && !leftPhone) {
-                return true;
-            }
+    const Private::SortKey leftKey = d->sortKeyFor(left);
+    const Private::SortKey rightKey = d->sortKeyFor(right);
 
-            return QString::localeAwareCompare(leftDisplayedName, rightDisplayedName) < 0;
-        } else {
-            if (leftPresence == Tp::ConnectionPresenceTypeAvailable) {
-                return true;
-            }
-            if (leftPresence == Tp::ConnectionPresenceTypeUnset ||
-                    leftPresence == Tp::ConnectionPresenceTypeOffline ||
-                    leftPresence == Tp::ConnectionPresenceTypeUnknown ||
-                    leftPresence == Tp::ConnectionPresenceTypeError) {
-                return false;
-            }
+    if (sortRole() == KTp::ContactPresenceTypeRole) {
+        if (leftKey.presenceRank != rightKey.presenceRank) {
+            return leftKey.presenceRank < rightKey.presenceRank;
+        }
 
-            return KTp::Presence::sortPriority(leftPresence) < KTp::Presence::sortPriority(rightPresence);
+        //presences are the same, compare client types
+        if (leftKey.phone != rightKey.phone) {
+            return rightKey.phone;
         }
     }
-    case Qt::DisplayRole:
-    default:
-        return QString::localeAwareCompare(leftDisplayedName, rightDisplayedName) < 0;
-    }
+
+    return leftKey.name.compare(rightKey.name) < 0;
 }
 
 
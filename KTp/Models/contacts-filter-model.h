@@ -41,7 +41,8 @@ class KTPMODELS_EXPORT ContactsFilterModel : public QSortFilterProxyModel
 
     Q_ENUMS(PresenceFilterFlag
             CapabilityFilterFlag
-            SubscriptionStateFilterFlag)
+            SubscriptionStateFilterFlag
+            SearchMode)
 
     Q_FLAGS(PresenceTypeFilterFlags
             CapabilityFilterFlags
@@ -77,6 +78,10 @@ class KTPMODELS_EXPORT ContactsFilterModel : public QSortFilterProxyModel
                RESET resetGlobalFilterMatchFlags
                WRITE setGlobalFilterMatchFlags
                NOTIFY globalFilterMatchFlagsChanged)
+    Q_PROPERTY(SearchMode searchMode
+               READ searchMode
+               WRITE setSearchMode
+               NOTIFY searchModeChanged)
 
     Q_PROPERTY(QString displayNameFilterString
                READ displayNameFilterString
@@ -146,6 +151,14 @@ class KTPMODELS_EXPORT ContactsFilterModel : public QSortFilterProxyModel
 
 public:
 
+    /**
+     * How the global filter string is matched
+     */
+    enum SearchMode {
+        SubstringSearch, ///< using globalFilterMatchFlags
+        FuzzySearch      ///< ranked and typo tolerant, see KTp::ContactSearchScoreRole
+    };
+
     enum PresenceTypeFilterFlag {
         DoNotFilterByPresence                  = 0x0000,
         HidePresenceTypeUnset                  = 0x0001,
@@ -233,6 +246,15 @@ public:
     Q_SLOT void setGlobalFilterMatchFlags(Qt::MatchFlags globalStringMatchFlags);
     Q_SIGNAL void globalFilterMatchFlagsChanged(Qt::MatchFlags globalStringMatchFlags);
 
+    /**
+     * In FuzzySearch mode the global filter is answered from a trigram index
+     * of the aliases, ids, account and group names. Matching contacts are
+     * sorted by their score first.
+     */
+    SearchMode searchMode() const;
+    Q_SLOT void setSearchMode(SearchMode searchMode);
+    Q_SIGNAL void searchModeChanged(SearchMode searchMode);
+
     QString displayNameFilterString() const;
     Q_SLOT void clearDisplayNameFilterString();
     Q_SLOT void setDisplayNameFilterString(const QString &displayNameFilterString);
@@ -301,9 +323,6 @@ protected:
 private:
     class Private;
     Private * const d;
-
-    Q_PRIVATE_SLOT(d, void sourceModelParentIndexChanged(const QModelIndex &sourceIndex))
-    Q_PRIVATE_SLOT(d, void sourceModelIndexChanged(const QModelIndex &sourceIndex))
 };
 } //namespace
 
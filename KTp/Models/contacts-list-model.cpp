@@ -26,6 +26,9 @@
 #include <TelepathyQt/AccountSet>
 #include "debug.h"
 #include <QPixmap>
+#include <QTimer>
+
+#include <algorithm>
 
 #include "contact.h"
 #include "presence.h"
@@ -39,11 +42,167 @@ public:
     {
     }
 
+    // The contacts of a connection, for telling them all at once that what
+    // we can do with them changed
+    struct ConnectionContacts
+    {
+        Tp::ConnectionPtr connection;
+        Tp::ContactPtr selfContact;
+        QSet<Tp::Contact*> contacts;
+    };
+
+    // What data() returns for a row, filled in lazily per field and
+    // invalidated from the contact's change signals
+    struct Snapshot
+    {
+        enum Field {
+            AliasField = 0x01,
+            AvatarField = 0x02,
+            PresenceField = 0x04,
+            CapabilitiesField = 0x08,
+            SubscriptionField = 0x10,
+            ClientTypesField = 0x20,
+            GroupsField = 0x40,
+            AccountField = 0x80
+        };
+
+        Snapshot() : valid(0) { }
+
+        uint valid;
+
+        QString displayName;
+        QString avatarPath;
+
+        Tp::ConnectionPresenceType presenceType;
+        int presenceSortPriority;
+        QString presenceName;
+        QString presenceMessage;
+        QString presenceIcon;
+
+        KTp::Contact::Capabilities capabilities;
+        QStringList tubes;
+
+        Tp::Contact::PresenceState subscriptionState;
+        Tp::Contact::PresenceState publishState;
+        bool blocked;
+
+        QStringList clientTypes;
+        QStringList groups;
+        Tp::AccountPtr account;
+    };
+
+    static uint fieldForRole(int role);
+    const Snapshot &snapshot(int row, uint field) const;
+
+    void reindex(int from);
+
     QList<Tp::ContactPtr> contacts;
+    // parallel to contacts
+    mutable QVector<Snapshot> snapshots;
+    // the row of each contact in contacts
+    QHash<Tp::Contact*, int> rows;
+    // contacts of dropped connections, removed together once we are back in the event loop
+    Tp::Contacts droppedContacts;
+    // roles changed since the last emitChanges(), per contact
+    QHash<Tp::Contact*, QVector<int> > changedRoles;
+    QHash<Tp::Connection*, ConnectionContacts> connections;
+    QHash<Tp::Contact*, Tp::Connection*> contactConnections;
     KTp::GlobalContactManager *contactManager;
     bool initialized;
 };
 
+uint KTp::ContactsListModel::Private::fieldForRole(int role)
+{
+    switch (role) {
+    case Qt::DisplayRole:
+        return Snapshot::AliasField;
+    case KTp::AccountRole:
+        return Snapshot::AccountField;
+    case KTp::ContactClientTypesRole:
+        return Snapshot::ClientTypesField;
+    case KTp::ContactAvatarPathRole:
+        return Snapshot::AvatarField;
+    case KTp::ContactGroupsRole:
+        return Snapshot::GroupsField;
+    case KTp::ContactPresenceNameRole:
+    case KTp::ContactPresenceMessageRole:
+    case KTp::ContactPresenceTypeRole:
+    case KTp::ContactPresenceIconRole:
+        return Snapshot::PresenceField;
+    case KTp::ContactSubscriptionStateRole:
+    case KTp::ContactPublishStateRole:
+    case KTp::ContactIsBlockedRole:
+        return Snapshot::SubscriptionField;
+    case KTp::ContactCanTextChatRole:
+    case KTp::ContactCanFileTransferRole:
+    case KTp::ContactCanAudioCallRole:
+    case KTp::ContactCanVideoCallRole:
+    case KTp::ContactTubesRole:
+        return Snapshot::CapabilitiesField;
+    default:
+        return 0;
+    }
+}
+
+const KTp::ContactsListModel::Private::Snapshot &KTp::ContactsListModel::Private::snapshot(int row, uint field) const
+{
+    Snapshot &snapshot = snapshots[row];
+    if (snapshot.valid & field) {
+        return snapshot;
+    }
+
+    const KTp::ContactPtr contact = KTp::ContactPtr::qObjectCast(contacts.at(row));
+    Q_ASSERT_X(!contact.isNull(), "KTp::ContactListModel::data()",
+               "Failed to cast Tp::ContactPtr to KTp::ContactPtr. Are you using KTp::ContactFactory?");
+
+    switch (field) {
+    case Snapshot::AliasField:
+        snapshot.displayName = contact->alias();
+        break;
+    case Snapshot::AvatarField:
+        snapshot.avatarPath = contact->avatarData().fileName;
+        break;
+    case Snapshot::PresenceField: {
+        const KTp::Presence presence = contact->presence();
+        snapshot.presenceType = presence.type();
+        snapshot.presenceSortPriority = KTp::Presence::sortPriority(presence.type());
+        snapshot.presenceName = presence.displayString();
+        snapshot.presenceMessage = presence.statusMessage();
+        snapshot.presenceIcon = presence.iconName();
+        break;
+    }
+    case Snapshot::CapabilitiesField:
+        snapshot.capabilities = contact->capabilityFlags();
+        snapshot.tubes = QStringList() << contact->streamTubeServicesCapability()
+                                       << contact->dbusTubeServicesCapability();
+        break;
+    case Snapshot::SubscriptionField:
+        snapshot.subscriptionState = contact->subscriptionState();
+        snapshot.publishState = contact->publishState();
+        snapshot.blocked = contact->isBlocked();
+        break;
+    case Snapshot::ClientTypesField:
+        snapshot.clientTypes = contact->clientTypes();
+        break;
+    case Snapshot::GroupsField:
+        snapshot.groups = contact->groups();
+        break;
+    case Snapshot::AccountField:
+        snapshot.account = contactManager->accountForContact(contact);
+        break;
+    }
+
+    snapshot.valid |= field;
+    return snapshot;
+}
+
+void KTp::ContactsListModel::Private::reindex(int from)
+{
+    for (int row = from; row < contacts.size(); ++row) {
+        rows[contacts.at(row).data()] = row;
+    }
+}
+
 
 KTp::ContactsListModel::ContactsListModel(QObject *parent) :
     QAbstractListModel(parent),
@@ -94,59 +253,64 @@ QVariant KTp::ContactsListModel::data(const QModelIndex &index, int role) const
     int row = index.row();
 
     if (row >=0 && row < d->contacts.size()) {
-        const KTp::ContactPtr contact = KTp::ContactPtr::qObjectCast(d->contacts[row]);
-        Q_ASSERT_X(!contact.isNull(), "KTp::ContactListModel::data()",
-                   "Failed to cast Tp::ContactPtr to KTp::ContactPtr. Are you using KTp::ContactFactory?");
-
         switch (role) {
         case KTp::RowTypeRole:
             return KTp::ContactRowType;
-        case Qt::DisplayRole:
-            return contact->alias();
-       case KTp::IdRole:
-            return contact->id();
-
+        case KTp::IdRole:
+            return d->contacts.at(row)->id();
         case KTp::ContactRole:
-            return QVariant::fromValue(contact);
+            return QVariant::fromValue(KTp::ContactPtr::qObjectCast(d->contacts.at(row)));
+        case KTp::ContactAvatarPixmapRole:
+            return KTp::ContactPtr::qObjectCast(d->contacts.at(row))->avatarPixmap();
+        default:
+            break;
+        }
+
+        const uint field = Private::fieldForRole(role);
+        if (!field) {
+            return QVariant();
+        }
+        const Private::Snapshot &snapshot = d->snapshot(row, field);
+
+        switch (role) {
+        case Qt::DisplayRole:
+            return snapshot.displayName;
         case KTp::AccountRole:
-            return QVariant::fromValue(d->contactManager->accountForContact(contact));
+            return QVariant::fromValue(snapshot.account);
 
         case KTp::ContactClientTypesRole:
-            return contact->clientTypes();
+            return snapshot.clientTypes;
         case KTp::ContactAvatarPathRole:
-            return contact->avatarData().fileName;
-        case KTp::ContactAvatarPixmapRole:
-            return contact->avatarPixmap();
+            return snapshot.avatarPath;
         case KTp::ContactGroupsRole:
-            return contact->groups();
+            return snapshot.groups;
 
         case KTp::ContactPresenceNameRole:
-            return contact->presence().displayString();
+            return snapshot.presenceName;
         case KTp::ContactPresenceMessageRole:
-            return contact->presence().statusMessage();
+            return snapshot.presenceMessage;
         case KTp::ContactPresenceTypeRole:
-            return contact->presence().type();
+            return snapshot.presenceType;
         case KTp::ContactPresenceIconRole:
-            return contact->presence().iconName();
+            return snapshot.presenceIcon;
 
         case KTp::ContactSubscriptionStateRole:
-            return contact->subscriptionState();
-          case KTp::ContactPublishStateRole:
-            return contact->publishState();
+            return snapshot.subscriptionState;
+        case KTp::ContactPublishStateRole:
+            return snapshot.publishState;
         case KTp::ContactIsBlockedRole:
-            return contact->isBlocked();
+            return snapshot.blocked;
 
         case KTp::ContactCanTextChatRole:
-            return contact->textChatCapability();
-          case KTp::ContactCanFileTransferRole:
-            return contact->fileTransferCapability();
+            return bool(snapshot.capabilities & KTp::Contact::TextChatCapability);
+        case KTp::ContactCanFileTransferRole:
+            return bool(snapshot.capabilities & KTp::Contact::FileTransferCapability);
         case KTp::ContactCanAudioCallRole:
-            return contact->audioCallCapability();
+            return bool(snapshot.capabilities & KTp::Contact::AudioCallCapability);
         case KTp::ContactCanVideoCallRole:
-            return contact->videoCallCapability();
+            return bool(snapshot.capabilities & KTp::Contact::VideoCallCapability);
         case KTp::ContactTubesRole:
-            return QStringList() << contact->streamTubeServicesCapability()
-                                 << contact->dbusTubeServicesCapability();
+            return snapshot.tubes;
         default:
             break;
         }
@@ -158,71 +322,124 @@ void KTp::ContactsListModel::onContactsChanged(const Tp::Contacts &added, const
 {
     //add contacts.
 
+    QList<Tp::ContactPtr> newContacts;
     Q_FOREACH(const Tp::ContactPtr &contact_uncasted, added) {
+        if (d->rows.contains(contact_uncasted.data())) {
+            continue;
+        }
+        newContacts.append(contact_uncasted);
+
         KTp::ContactPtr contact = KTp::ContactPtr::qObjectCast(contact_uncasted);
 
         connect(contact.data(),
                 SIGNAL(aliasChanged(QString)),
-                SLOT(onChanged()));
+                SLOT(onAliasChanged()));
         connect(contact.data(),
                 SIGNAL(avatarTokenChanged(QString)),
-                SLOT(onChanged()));
+                SLOT(onAvatarChanged()));
         connect(contact.data(),
                 SIGNAL(avatarDataChanged(Tp::AvatarData)),
-                SLOT(onChanged()));
+                SLOT(onAvatarChanged()));
         connect(contact.data(),
                 SIGNAL(presenceChanged(Tp::Presence)),
-                SLOT(onChanged()));
-        connect(contact->manager()->connection()->selfContact().data(),
-                SIGNAL(capabilitiesChanged(Tp::ContactCapabilities)),
-                SLOT(onChanged()));
+                SLOT(onPresenceChanged()));
         connect(contact.data(),
                 SIGNAL(capabilitiesChanged(Tp::ContactCapabilities)),
-                SLOT(onChanged()));
-        connect(contact.data(),
-                SIGNAL(locationUpdated(Tp::LocationInfo)),
-                SLOT(onChanged()));
-        connect(contact.data(),
-                SIGNAL(infoFieldsChanged(Tp::Contact::InfoFields)),
-                SLOT(onChanged()));
+                SLOT(onCapabilitiesChanged()));
         connect(contact.data(),
                 SIGNAL(subscriptionStateChanged(Tp::Contact::PresenceState)),
-                SLOT(onChanged()));
+                SLOT(onSubscriptionStateChanged()));
         connect(contact.data(),
                 SIGNAL(publishStateChanged(Tp::Contact::PresenceState,QString)),
-                SLOT(onChanged()));
+                SLOT(onPublishStateChanged()));
         connect(contact.data(),
                 SIGNAL(blockStatusChanged(bool)),
-                SLOT(onChanged()));
+                SLOT(onBlockStatusChanged()));
         connect(contact.data(),
                 SIGNAL(clientTypesChanged(QStringList)),
-                SLOT(onChanged()));
+                SLOT(onClientTypesChanged()));
         connect(contact.data(),
                 SIGNAL(addedToGroup(QString)),
-                SLOT(onChanged()));
+                SLOT(onGroupsChanged()));
         connect(contact.data(),
                 SIGNAL(removedFromGroup(QString)),
-                SLOT(onChanged()));
+                SLOT(onGroupsChanged()));
 
         connect(contact.data(),
                 SIGNAL(invalidated()),
                 SLOT(onConnectionDropped()));
+
+        // one subscription to the self contact per connection, not per contact
+        const Tp::ConnectionPtr connection = contact->manager()->connection();
+        Private::ConnectionContacts &connectionContacts = d->connections[connection.data()];
+        if (connectionContacts.contacts.isEmpty()) {
+            connectionContacts.connection = connection;
+            connectionContacts.selfContact = connection->selfContact();
+            connect(connectionContacts.selfContact.data(),
+                    SIGNAL(capabilitiesChanged(Tp::ContactCapabilities)),
+                    SLOT(onSelfCapabilitiesChanged()));
+        }
+        connectionContacts.contacts.insert(contact.data());
+        d->contactConnections.insert(contact.data(), connection.data());
     }
 
-    if (added.size() > 0) {
-        beginInsertRows(QModelIndex(), d->contacts.size(), d->contacts.size() + added.size() -1);
-        d->contacts.append(added.values());
+    if (newContacts.size() > 0) {
+        const int first = d->contacts.size();
+        beginInsertRows(QModelIndex(), first, first + newContacts.size() - 1);
+        d->contacts.append(newContacts);
+        d->snapshots.resize(d->contacts.size());
+        d->reindex(first);
         endInsertRows();
     }
 
     //remove contacts
+    QVector<int> removedRows;
     Q_FOREACH(const Tp::ContactPtr &contact, removed) {
-        int row = d->contacts.indexOf(contact);
-        if (row >= 0) { //if contact found in list
-            beginRemoveRows(QModelIndex(), row, row);
-            d->contacts.removeOne(contact);
+        QHash<Tp::Contact*, int>::const_iterator it = d->rows.constFind(contact.data());
+        if (it != d->rows.constEnd()) { //if contact found in list
+            removedRows.append(it.value());
+            disconnect(contact.data(), nullptr, this, nullptr);
+        }
+        d->droppedContacts.remove(contact);
+        d->changedRoles.remove(contact.data());
+
+        const QHash<Tp::Connection*, Private::ConnectionContacts>::iterator connection = d->connections.find(d->contactConnections.take(contact.data()));
+        if (connection != d->connections.end()) {
+            connection->contacts.remove(contact.data());
+            if (connection->contacts.isEmpty()) {
+                disconnect(connection->selfContact.data(),
+                           SIGNAL(capabilitiesChanged(Tp::ContactCapabilities)),
+                           this, SLOT(onSelfCapabilitiesChanged()));
+                d->connections.erase(connection);
+            }
+        }
+    }
+
+    if (!removedRows.isEmpty()) {
+        std::sort(removedRows.begin(), removedRows.end());
+
+        // remove each run of consecutive rows at once, starting from the end
+        // so that the rows still to be removed don't move
+        int i = removedRows.size() - 1;
+        while (i >= 0) {
+            const int last = removedRows.at(i);
+            int first = last;
+            while (i > 0 && removedRows.at(i - 1) == first - 1) {
+                --i;
+                --first;
+            }
+            --i;
+
+            beginRemoveRows(QModelIndex(), first, last);
+            for (int row = first; row <= last; ++row) {
+                d->rows.remove(d->contacts.at(row).data());
+            }
+            d->contacts.erase(d->contacts.begin() + first, d->contacts.begin() + last + 1);
+            d->snapshots.erase(d->snapshots.begin() + first, d->snapshots.begin() + last + 1);
             endRemoveRows();
         }
+
+        d->reindex(removedRows.first());
     }
 
     if (!d->initialized) {
@@ -231,19 +448,150 @@ void KTp::ContactsListModel::onContactsChanged(const Tp::Contacts &added, const
     }
 }
 
-void KTp::ContactsListModel::onChanged()
+void KTp::ContactsListModel::onAliasChanged()
+{
+    markChanged(qobject_cast<Tp::Contact*>(sender()), QVector<int>() << Qt::DisplayRole);
+}
+
+void KTp::ContactsListModel::onAvatarChanged()
+{
+    markChanged(qobject_cast<Tp::Contact*>(sender()), QVector<int>()
+                << KTp::ContactAvatarPathRole
+                << KTp::ContactAvatarPixmapRole);
+}
+
+void KTp::ContactsListModel::onPresenceChanged()
+{
+    markChanged(qobject_cast<Tp::Contact*>(sender()), QVector<int>()
+                << KTp::ContactPresenceNameRole
+                << KTp::ContactPresenceMessageRole
+                << KTp::ContactPresenceTypeRole
+                << KTp::ContactPresenceIconRole);
+}
+
+static const QVector<int> s_capabilityRoles = QVector<int>()
+        << KTp::ContactCanTextChatRole
+        << KTp::ContactCanFileTransferRole
+        << KTp::ContactCanAudioCallRole
+        << KTp::ContactCanVideoCallRole
+        << KTp::ContactTubesRole;
+
+void KTp::ContactsListModel::onCapabilitiesChanged()
+{
+    markChanged(qobject_cast<Tp::Contact*>(sender()), s_capabilityRoles);
+}
+
+void KTp::ContactsListModel::onSelfCapabilitiesChanged()
+{
+    // capabilities are those both we and the contact have, so ours changing
+    // changes them for every contact of the connection
+    Tp::Contact *selfContact = qobject_cast<Tp::Contact*>(sender());
+    Q_FOREACH (const Private::ConnectionContacts &connection, d->connections) {
+        if (connection.selfContact.data() == selfContact) {
+            Q_FOREACH (Tp::Contact *contact, connection.contacts) {
+                markChanged(contact, s_capabilityRoles);
+            }
+        }
+    }
+}
+
+void KTp::ContactsListModel::onSubscriptionStateChanged()
+{
+    markChanged(qobject_cast<Tp::Contact*>(sender()), QVector<int>() << KTp::ContactSubscriptionStateRole);
+}
+
+void KTp::ContactsListModel::onPublishStateChanged()
+{
+    markChanged(qobject_cast<Tp::Contact*>(sender()), QVector<int>() << KTp::ContactPublishStateRole);
+}
+
+void KTp::ContactsListModel::onBlockStatusChanged()
+{
+    markChanged(qobject_cast<Tp::Contact*>(sender()), QVector<int>() << KTp::ContactIsBlockedRole);
+}
+
+void KTp::ContactsListModel::onClientTypesChanged()
+{
+    markChanged(qobject_cast<Tp::Contact*>(sender()), QVector<int>() << KTp::ContactClientTypesRole);
+}
+
+void KTp::ContactsListModel::onGroupsChanged()
+{
+    markChanged(qobject_cast<Tp::Contact*>(sender()), QVector<int>() << KTp::ContactGroupsRole);
+}
+
+void KTp::ContactsListModel::markChanged(Tp::Contact *contact, const QVector<int> &roles)
+{
+    const QHash<Tp::Contact*, int>::const_iterator row = d->rows.constFind(contact);
+    if (row == d->rows.constEnd()) {
+        return;
+    }
+
+    // data() reads them again from the contact from now on
+    Private::Snapshot &snapshot = d->snapshots[row.value()];
+    Q_FOREACH (int role, roles) {
+        snapshot.valid &= ~Private::fieldForRole(role);
+    }
+
+    // When an account reconnects every contact changes several times in a
+    // row, collect the changes and emit them once we are back in the event loop
+    if (d->changedRoles.isEmpty()) {
+        QTimer::singleShot(0, this, SLOT(emitChanges()));
+    }
+
+    QVector<int> &changed = d->changedRoles[contact];
+    Q_FOREACH (int role, roles) {
+        if (!changed.contains(role)) {
+            changed.append(role);
+        }
+    }
+}
+
+void KTp::ContactsListModel::emitChanges()
 {
-    KTp::ContactPtr contact(qobject_cast<KTp::Contact*>(sender()));
-    int row = d->contacts.indexOf(contact);
-    if (row > 0) {
-        QModelIndex index = createIndex(row, 0);
-        dataChanged(index, index);
+    QVector<QPair<int, QVector<int> > > changes;
+    changes.reserve(d->changedRoles.size());
+    for (QHash<Tp::Contact*, QVector<int> >::iterator it = d->changedRoles.begin(); it != d->changedRoles.end(); ++it) {
+        const QHash<Tp::Contact*, int>::const_iterator row = d->rows.constFind(it.key());
+        if (row != d->rows.constEnd()) {
+            std::sort(it.value().begin(), it.value().end());
+            changes.append(qMakePair(row.value(), it.value()));
+        }
+    }
+    d->changedRoles.clear();
+
+    std::sort(changes.begin(), changes.end(), [](const QPair<int, QVector<int> > &a, const QPair<int, QVector<int> > &b) {
+        return a.first < b.first;
+    });
+
+    // one signal per run of consecutive rows with the same changed roles
+    int i = 0;
+    while (i < changes.size()) {
+        int last = i;
+        while (last + 1 < changes.size()
+                && changes.at(last + 1).first == changes.at(last).first + 1
+                && changes.at(last + 1).second == changes.at(i).second) {
+            ++last;
+        }
+        Q_EMIT dataChanged(createIndex(changes.at(i).first, 0), createIndex(changes.at(last).first, 0), changes.at(i).second);
+        i = last + 1;
     }
 }
 
 void KTp::ContactsListModel::onConnectionDropped()
 {
-    KTp::ContactPtr contact(qobject_cast<KTp::Contact*>(sender()));
-    onContactsChanged(Tp::Contacts(), Tp::Contacts() << contact);
+    // A connection going away invalidates all of its contacts one after
+    // the other, collect them to remove them in as few ranges as possible
+    if (d->droppedContacts.isEmpty()) {
+        QTimer::singleShot(0, this, SLOT(removeDroppedContacts()));
+    }
+    d->droppedContacts << Tp::ContactPtr(qobject_cast<Tp::Contact*>(sender()));
+}
+
+void KTp::ContactsListModel::removeDroppedContacts()
+{
+    const Tp::Contacts dropped = d->droppedContacts;
+    d->droppedContacts.clear();
+    onContactsChanged(Tp::Contacts(), dropped);
 }
 
@@ -45,11 +45,24 @@ Q_SIGNALS:
 
 private Q_SLOTS:
     void onContactsChanged(const Tp::Contacts &added, const Tp::Contacts &removed);
-    void onChanged();
+    void onAliasChanged();
+    void onAvatarChanged();
+    void onPresenceChanged();
+    void onCapabilitiesChanged();
+    void onSelfCapabilitiesChanged();
+    void onSubscriptionStateChanged();
+    void onPublishStateChanged();
+    void onBlockStatusChanged();
+    void onClientTypesChanged();
+    void onGroupsChanged();
+    void emitChanges();
     void onConnectionDropped();
+    void removeDroppedContacts();
 
 private:
     Q_DISABLE_COPY(ContactsListModel)
+    void markChanged(Tp::Contact *contact, const QVector<int> &roles);
+
     class Private;
     Private *d;
 
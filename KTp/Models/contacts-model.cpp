@@ -232,5 +232,6 @@ QHash<int, QByteArray> KTp::ContactsModel::roleNames() const
     roles[KTp::ContactCanVideoCallRole]= "videoCall";
     roles[KTp::ContactTubesRole]= "tubes";
     roles[KTp::PersonIdRole]= "personId";
+    roles[KTp::ContactSearchScoreRole]= "searchScore";
     return roles;
 }
@@ -55,6 +55,11 @@ QSet<QString> KTp::GroupsTreeProxyModel::groupsForIndex(const QModelIndex &sourc
 }
 
 
+QVector<int> KTp::GroupsTreeProxyModel::groupRoles() const
+{
+    return QVector<int>() << KTp::ContactGroupsRole;
+}
+
 QVariant KTp::GroupsTreeProxyModel::dataForGroup(const QString &group, int role) const
 {
     switch (role) {
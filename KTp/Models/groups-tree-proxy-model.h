@@ -37,6 +37,7 @@ public:
    
     QSet<QString> groupsForIndex(const QModelIndex &sourceIndex) const override;
     QVariant dataForGroup(const QString &group, int role) const override;
+    QVector<int> groupRoles() const override;
 private:
     class Private;
     Private *d;
@@ -21,6 +21,11 @@
 
 namespace KTp {
 
+bool MessageFilterTriggers::isEmpty() const
+{
+    return characters.isEmpty() && substrings.isEmpty() && messageTypes.isEmpty();
+}
+
 AbstractMessageFilter::AbstractMessageFilter(QObject* parent)
     : QObject(parent)
 {
@@ -36,6 +41,28 @@ void AbstractMessageFilter::filterMessage(KTp::Message &message, const KTp::Mess
     Q_UNUSED(context)
 }
 
+void AbstractMessageFilter::filterMessages(QList<KTp::Message> &messages, const KTp::MessageContext &context)
+{
+    for (int i = 0; i < messages.size(); ++i) {
+        filterMessage(messages[i], context);
+    }
+}
+
+bool AbstractMessageFilter::isReentrant() const
+{
+    return false;
+}
+
+bool AbstractMessageFilter::canProcessInChunks() const
+{
+    return false;
+}
+
+KTp::MessageFilterTriggers AbstractMessageFilter::triggers() const
+{
+    return KTp::MessageFilterTriggers();
+}
+
 QStringList AbstractMessageFilter::requiredScripts()
 {
     return QStringList();
@@ -31,6 +31,18 @@
 namespace KTp
 {
 
+/** Cheap conditions under which a filter has something to do with a message, see AbstractMessageFilter::triggers().
+ *  The filter runs on messages containing any of the characters or substrings, or having any of the types.*/
+struct KTPCOMMONINTERNALS_EXPORT MessageFilterTriggers
+{
+    /** Whether no condition is set, in which case the filter runs on every message */
+    bool isEmpty() const;
+
+    QString characters;
+    QStringList substrings;
+    QList<Tp::ChannelTextMessageType> messageTypes;
+};
+
 class KTPCOMMONINTERNALS_EXPORT AbstractMessageFilter : public QObject
 {
     Q_OBJECT
@@ -42,6 +54,31 @@ class KTPCOMMONINTERNALS_EXPORT AbstractMessageFilter : public QObject
     /** Filter messages to show on the UI recieved by another contact*/
     virtual void filterMessage(KTp::Message &message, const KTp::MessageContext &context);
 
+    /** Filter a batch of messages, e.g. a page of history, all from the same context.
+     *  The default implementation calls filterMessage() for each of them. Reimplement it
+     *  to share expensive setup (regexps, config lookups...) between the messages.*/
+    virtual void filterMessages(QList<KTp::Message> &messages, const KTp::MessageContext &context);
+
+    /** Whether separate instances of this filter can safely run at the same time in different threads.
+     *  Reentrant filters are used to process history on worker threads, in instances of their own
+     *  created through the plugin factory, so they must not touch GUI objects or share unprotected
+     *  state between instances. Returns false by default.*/
+    virtual bool isReentrant() const;
+
+    /** Whether the filter gives the same result on a very large message cut into chunks as on the whole of it,
+     *  see MessageProcessor::processIncomingMessageInChunks(). Chunks end after a line break or after a single
+     *  space between two words, so filters whose syntax can span those, e.g. LaTeX between $$, must not claim it.
+     *  Messages are only processed in chunks when all loaded filters can. Returns false by default.*/
+    virtual bool canProcessInChunks() const;
+
+    /** Conditions under which filterMessage() and filterMessages() can change a message at all, e.g. a ':'
+     *  for an emoticon filter. Messages which fire none of them are not handed to the filter.
+     *  They are all checked in a single pass over the text of the message as it was received, before
+     *  any filter ran, so they must not rely on changes by other filters such as the HTML escaping.
+     *  Outgoing messages always go through every filter. Returns no triggers, i.e. every message, by default.
+     *  Called once when the filter is loaded.*/
+    virtual KTp::MessageFilterTriggers triggers() const;
+
     /** Scripts that must be included in the <head> section of the html required by this message filter.*/
     virtual QStringList requiredScripts();
 
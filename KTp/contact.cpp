@@ -25,6 +25,7 @@
 #include <TelepathyQt/Utils>
 
 #include <QBitmap>
+#include <QHash>
 #include <QPixmap>
 #include <QPixmapCache>
 
@@ -34,14 +35,73 @@
 
 #include "capabilities-hack-private.h"
 
+// The self contact of a connection is shared by all of its contacts, so it is watched once
+// per connection: the generation counts the changes of its capabilities, and of the self contact
+// itself. Contacts remember the generation their capabilities were computed at.
+struct SelfCapabilities
+{
+    SelfCapabilities():
+        generation(0)
+    { }
+
+    uint generation;
+    QMetaObject::Connection capabilitiesChanged;
+};
+
+typedef QHash<Tp::Connection*, SelfCapabilities> SelfCapabilitiesHash;
+Q_GLOBAL_STATIC(SelfCapabilitiesHash, s_selfCapabilities)
+
+static void watchSelfContact(Tp::Connection *connection)
+{
+    SelfCapabilities &record = (*s_selfCapabilities)[connection];
+    QObject::disconnect(record.capabilitiesChanged);
+    record.generation++;
+
+    const Tp::ContactPtr selfContact = connection->selfContact();
+    if (selfContact) {
+        record.capabilitiesChanged = QObject::connect(selfContact.data(), &Tp::Contact::capabilitiesChanged, connection, [connection]() {
+            (*s_selfCapabilities)[connection].generation++;
+        });
+    }
+}
+
+// 0 while there is no self contact, as nothing can be cached before
+static uint selfCapabilitiesGeneration(const Tp::ConnectionPtr &connection)
+{
+    if (!connection->selfContact()) {
+        return 0;
+    }
+
+    Tp::Connection *rawConnection = connection.data();
+    SelfCapabilitiesHash::ConstIterator it = s_selfCapabilities->constFind(rawConnection);
+    if (it != s_selfCapabilities->constEnd()) {
+        return it->generation;
+    }
+
+    QObject::connect(rawConnection, &Tp::Connection::selfContactChanged, rawConnection, [rawConnection]() {
+        watchSelfContact(rawConnection);
+    });
+    QObject::connect(rawConnection, &QObject::destroyed, [rawConnection]() {
+        // connections may outlive the hash at exit
+        if (!s_selfCapabilities.isDestroyed()) {
+            s_selfCapabilities->remove(rawConnection);
+        }
+    });
+    watchSelfContact(rawConnection);
+    return s_selfCapabilities->value(rawConnection).generation;
+}
+
 KTp::Contact::Contact(Tp::ContactManager *manager, const Tp::ReferencedHandles &handle, const Tp::Features &requestedFeatures, const QVariantMap &attributes)
-    : Tp::Contact(manager, handle, requestedFeatures, attributes)
+    : Tp::Contact(manager, handle, requestedFeatures, attributes),
+      m_capabilitiesValid(false),
+      m_selfCapabilitiesGeneration(0)
 {
     connect(manager->connection().data(), SIGNAL(destroyed()), SIGNAL(invalidated()));
     connect(manager->connection().data(), SIGNAL(invalidated(Tp::DBusProxy*,QString,QString)), SIGNAL(invalidated()));
     connect(this, SIGNAL(avatarTokenChanged(QString)), SLOT(invalidateAvatarCache()));
     connect(this, SIGNAL(avatarDataChanged(Tp::AvatarData)), SLOT(invalidateAvatarCache()));
     connect(this, SIGNAL(presenceChanged(Tp::Presence)), SLOT(onPresenceChanged(Tp::Presence)));
+    connect(this, SIGNAL(capabilitiesChanged(Tp::ContactCapabilities)), SLOT(invalidateCapabilities()));
 }
 
 void KTp::Contact::onPresenceChanged(const Tp::Presence &presence)
@@ -77,64 +137,90 @@ KTp::Presence KTp::Contact::presence() const
     return KTp::Presence(Tp::Contact::presence());
 }
 
-bool KTp::Contact::textChatCapability() const
+KTp::Contact::Capabilities KTp::Contact::capabilityFlags() const
 {
     if (!manager() || !manager()->connection()) {
-        return false;
+        return Capabilities();
     }
 
-    return capabilities().textChats();
+    const uint generation = selfCapabilitiesGeneration(manager()->connection());
+    if (!m_capabilitiesValid || generation != m_selfCapabilitiesGeneration) {
+        const_cast<KTp::Contact*>(this)->updateCapabilities(generation);
+    }
+    return m_capabilities;
 }
 
-bool KTp::Contact::audioCallCapability() const
+bool KTp::Contact::textChatCapability() const
 {
-    if (!manager() || !manager()->connection()) {
-        return false;
-    }
+    return capabilityFlags() & TextChatCapability;
+}
 
-    Tp::ConnectionPtr connection = manager()->connection();
-    bool contactCanStreamAudio = CapabilitiesHackPrivate::audioCalls(
-                capabilities(), connection->cmName());
-    bool selfCanStreamAudio = CapabilitiesHackPrivate::audioCalls(
-                connection->selfContact()->capabilities(), connection->cmName());
-    return contactCanStreamAudio && selfCanStreamAudio;
+bool KTp::Contact::audioCallCapability() const
+{
+    return capabilityFlags() & AudioCallCapability;
 }
 
 bool KTp::Contact::videoCallCapability() const
 {
-    if (!manager() || !manager()->connection()) {
-        return false;
-    }
-
-    Tp::ConnectionPtr connection = manager()->connection();
-    bool contactCanStreamVideo = CapabilitiesHackPrivate::videoCalls(
-                capabilities(), connection->cmName());
-    bool selfCanStreamVideo = CapabilitiesHackPrivate::videoCalls(
-                connection->selfContact()->capabilities(), connection->cmName());
-    return contactCanStreamVideo && selfCanStreamVideo;
+    return capabilityFlags() & VideoCallCapability;
 }
 
 bool KTp::Contact::fileTransferCapability()  const
 {
-    if (!manager() || !manager()->connection()) {
-        return false;
-    }
-
-    bool contactCanHandleFiles = capabilities().fileTransfers();
-    bool selfCanHandleFiles = manager()->connection()->selfContact()->capabilities().fileTransfers();
-    return contactCanHandleFiles && selfCanHandleFiles;
+    return capabilityFlags() & FileTransferCapability;
 }
 
 bool KTp::Contact::collaborativeEditingCapability() const
 {
-    if (!manager() || !manager()->connection()) {
-        return false;
+    return capabilityFlags() & CollaborativeEditingCapability;
+}
+
+void KTp::Contact::updateCapabilities(uint selfGeneration)
+{
+    Tp::ConnectionPtr connection = manager()->connection();
+    Tp::ContactPtr selfContact = connection->selfContact();
+
+    m_capabilities = Capabilities();
+
+    const Tp::ContactCapabilities contactCapabilities = capabilities();
+    if (contactCapabilities.textChats()) {
+        m_capabilities |= TextChatCapability;
+    }
+
+    // everything else needs our side to support it too; until the self contact
+    // is there we can't tell, so don't cache anything
+    if (!selfContact || selfGeneration == 0) {
+        m_capabilitiesValid = false;
+        return;
+    }
+
+    const Tp::ContactCapabilities selfCapabilities = selfContact->capabilities();
+    const QString cmName = connection->cmName();
+
+    if (CapabilitiesHackPrivate::audioCalls(contactCapabilities, cmName)
+        && CapabilitiesHackPrivate::audioCalls(selfCapabilities, cmName)) {
+        m_capabilities |= AudioCallCapability;
+    }
+    if (CapabilitiesHackPrivate::videoCalls(contactCapabilities, cmName)
+        && CapabilitiesHackPrivate::videoCalls(selfCapabilities, cmName)) {
+        m_capabilities |= VideoCallCapability;
+    }
+    if (contactCapabilities.fileTransfers() && selfCapabilities.fileTransfers()) {
+        m_capabilities |= FileTransferCapability;
     }
 
     static const QString collab(QLatin1String("infinote"));
-    bool selfCanShare = manager()->connection()->selfContact()->capabilities().streamTubes(collab);
-    bool otherCanShare = capabilities().streamTubes(collab);
-    return selfCanShare && otherCanShare;
+    if (contactCapabilities.streamTubes(collab) && selfCapabilities.streamTubes(collab)) {
+        m_capabilities |= CollaborativeEditingCapability;
+    }
+
+    m_capabilitiesValid = true;
+    m_selfCapabilitiesGeneration = selfGeneration;
+}
+
+void KTp::Contact::invalidateCapabilities()
+{
+    m_capabilitiesValid = false;
 }
 
 QStringList KTp::Contact::dbusTubeServicesCapability() const
@@ -34,6 +34,23 @@ public:
 
     KTp::Presence presence() const;
 
+    enum Capability {
+        TextChatCapability = 0x01,
+        AudioCallCapability = 0x02,
+        VideoCallCapability = 0x04,
+        FileTransferCapability = 0x08,
+        CollaborativeEditingCapability = 0x10
+    };
+    Q_DECLARE_FLAGS(Capabilities, Capability)
+
+    /**
+     * Returns what can be done with this contact from our own account, i.e.
+     * what both this contact and the self contact support.
+     *
+     * This is computed once and kept until the capabilities of either change,
+     * prefer it to the individual methods below when checking several.
+     */
+    Capabilities capabilityFlags() const;
 
     /** Returns true if text chats can be started with this contact*/
     bool textChatCapability() const;
@@ -70,16 +87,24 @@ Q_SIGNALS:
 private Q_SLOTS:
     void invalidateAvatarCache();
     void onPresenceChanged(const Tp::Presence &presence);
+    void invalidateCapabilities();
 
 private:
     static QStringList getCommonElements(const QStringList &list1, const QStringList &list2);
     void avatarToGray(QPixmap &avatar);
     QString keyCache() const;
     QString buildAvatarPath(const QString &avatarToken);
+    void updateCapabilities(uint selfGeneration);
 
     QString m_accountUniqueIdentifier;
+    Capabilities m_capabilities;
+    bool m_capabilitiesValid;
+    // see selfCapabilitiesGeneration() in contact.cpp
+    uint m_selfCapabilitiesGeneration;
 };
 
+Q_DECLARE_OPERATORS_FOR_FLAGS(Contact::Capabilities)
+
 
 typedef Tp::SharedPtr<KTp::Contact> ContactPtr;
 
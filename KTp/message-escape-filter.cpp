@@ -18,10 +18,95 @@
 
 #include "message-filters-private.h"
 
-#include <QTextDocument> //needed for Qt::escape
+#include <QUrl>
 
 #include <KTp/text-parser.h>
 
+/**
+ * Appends text[from, to) to @p out as HTML, in a single pass.
+ *
+ * This produces the same result as QString::toHtmlEscaped() followed by
+ * turning "\n " into "<br/>&nbsp;", newlines into "<br/>", tabs into
+ * "&nbsp; &nbsp; " and every pair of consecutive spaces into " &nbsp;".
+ */
+static void appendEscapedText(QString &out, const QChar *text, int from, int to)
+{
+    int plain = from; // start of the characters that can be copied verbatim
+    int spaces = 0;   // pending run of spaces
+
+    for (int i = from; i < to; ++i) {
+        const QChar c = text[i];
+
+        if (c == QLatin1Char(' ')) {
+            out.append(text + plain, i - plain);
+            plain = i + 1;
+            ++spaces;
+            continue;
+        }
+
+        if (spaces > 0) {
+            // keep multiple whitespaces
+            for (int j = 0; j < spaces / 2; ++j) {
+                out.append(QLatin1String(" &nbsp;"));
+            }
+            if (spaces % 2) {
+                out.append(QLatin1Char(' '));
+            }
+            spaces = 0;
+        }
+
+        QLatin1String replacement("");
+        switch (c.unicode()) {
+        case '&':
+            replacement = QLatin1String("&amp;");
+            break;
+        case '<':
+            replacement = QLatin1String("&lt;");
+            break;
+        case '>':
+            replacement = QLatin1String("&gt;");
+            break;
+        case '"':
+            replacement = QLatin1String("&quot;");
+            break;
+        case '\n':
+            if (i + 1 < to && text[i + 1] == QLatin1Char(' ')) {
+                //keep leading whitespaces
+                out.append(text + plain, i - plain);
+                out.append(QLatin1String("<br/>&nbsp;"));
+                plain = ++i + 1;
+                continue;
+            }
+            replacement = QLatin1String("<br/>");
+            break;
+        case '\r':
+            replacement = QLatin1String("<br/>");
+            break;
+        case '\t':
+            // replace tabs by 4 spaces, the last one of which may pair up with following spaces
+            out.append(text + plain, i - plain);
+            out.append(QLatin1String("&nbsp; &nbsp;"));
+            plain = i + 1;
+            spaces = 1;
+            continue;
+        default:
+            continue;
+        }
+
+        out.append(text + plain, i - plain);
+        out.append(replacement);
+        plain = i + 1;
+    }
+
+    out.append(text + plain, to - plain);
+    for (int j = 0; j < spaces / 2; ++j) {
+        out.append(QLatin1String(" &nbsp;"));
+    }
+    if (spaces % 2) {
+        out.append(QLatin1Char(' '));
+    }
+}
+
 MessageEscapeFilter::MessageEscapeFilter(QObject *parent)
     : KTp::AbstractMessageFilter(parent)
 {
@@ -38,54 +123,64 @@ void MessageEscapeFilter::filterMessage(KTp::Message &message, const KTp::Messag
     // it would also escape the newly inserted <a href...> links and the user would
     // get &lt;a href.../a&gt; and no clickable links.
     //
-    // Therefore we first detect the links, replace them with placeholders,
-    // then escape everything, then replace placeholders with actual links.
+    // Therefore we first detect the links, then write the text between them escaped
+    // and the links themselves as <a href...> into a single output buffer.
 
-    QString messageText = message.mainMessagePart();
+    const QString messageText = message.mainMessagePart();
+    const QChar *text = messageText.constData();
 
-    QVariantList urls = message.property("Urls").toList();
+    static const int urlsKey = KTp::Message::propertyKey("Urls");
+    QVariantList urls = message.property(urlsKey).toList();
 
     // link detection
-    KTp::TextUrlData parsedUrl = KTp::TextParser::instance()->extractUrlData(messageText);
-
-    QList<QPair<QString, QString> > placeholders;
+    const KTp::TextUrlData parsedUrl = KTp::TextParser::instance()->extractUrlData(messageText);
 
-    int offset = 0;
+    int expectedSize = messageText.size() + messageText.size() / 8;
     for (int i = 0; i < parsedUrl.fixedUrls.size(); i++) {
-         QUrl url(parsedUrl.fixedUrls.at(i));
-         if (url.scheme() != QLatin1String("mailto")) {
-             QString originalText = messageText.mid(parsedUrl.urlRanges.at(i).first + offset, parsedUrl.urlRanges.at(i).second);
-             QString link = QString::fromLatin1("<a href=\"%1\">%2</a>").arg(QString::fromLatin1(url.toEncoded()), originalText);
-
-             QString placeholder = QString::fromLatin1("#K#T#P%1#LINK").arg(i);
-
-             // replace the link with a placeholder^ so it passes through the escaping phase,
-             // then it will be replaced back for the actual link
-             messageText.replace(parsedUrl.urlRanges.at(i).first + offset, parsedUrl.urlRanges.at(i).second, placeholder);
+        expectedSize += parsedUrl.fixedUrls.at(i).size() + 15;
+    }
 
-             placeholders << qMakePair(placeholder, link);
+    QString escapedMessage;
+    escapedMessage.reserve(expectedSize);
 
-             urls.append(url);
+    int pos = 0;
+    for (int i = 0; i < parsedUrl.fixedUrls.size(); i++) {
+        QUrl url(parsedUrl.fixedUrls.at(i));
+        // email addresses are not linkified, they are escaped as part of the text
+        if (url.scheme() == QLatin1String("mailto")) {
+            continue;
+        }
 
-             //after the first replacement is made, the original position values are not valid anymore, this adjusts them
-             offset += placeholder.length() - originalText.length();
-         }
-     }
+        const int start = parsedUrl.urlRanges.at(i).first;
+        const int length = parsedUrl.urlRanges.at(i).second;
 
-    message.setProperty("Urls", urls);
+        appendEscapedText(escapedMessage, text, pos, start);
 
-    QString escapedMessage = messageText.toHtmlEscaped();
+        escapedMessage.append(QLatin1String("<a href=\""));
+        escapedMessage.append(QString::fromLatin1(url.toEncoded()));
+        escapedMessage.append(QLatin1String("\">"));
+        escapedMessage.append(text + start, length);
+        escapedMessage.append(QLatin1String("</a>"));
 
-    escapedMessage.replace(QLatin1String("\n "), QLatin1String("<br/>&nbsp;")); //keep leading whitespaces
-    escapedMessage.replace(QLatin1Char('\n'), QLatin1String("<br/>"));
-    escapedMessage.replace(QLatin1Char('\r'), QLatin1String("<br/>"));
-    escapedMessage.replace(QLatin1Char('\t'), QLatin1String("&nbsp; &nbsp; ")); // replace tabs by 4 spaces
-    escapedMessage.replace(QLatin1String("  "), QLatin1String(" &nbsp;")); // keep multiple whitespaces
+        urls.append(url);
 
-    // replace link placeholders with actual links
-    for (int i = 0; i < placeholders.size(); i++) {
-        escapedMessage.replace(placeholders.at(i).first, placeholders.at(i).second);
+        pos = start + length;
     }
 
+    appendEscapedText(escapedMessage, text, pos, messageText.size());
+
+    message.setProperty(urlsKey, urls);
     message.setMainMessagePart(escapedMessage);
 }
+
+bool MessageEscapeFilter::isReentrant() const
+{
+    return true;
+}
+
+// urls never contain whitespace, and the only escaping across characters is
+// for runs of whitespace, which chunks do not end in
+bool MessageEscapeFilter::canProcessInChunks() const
+{
+    return true;
+}
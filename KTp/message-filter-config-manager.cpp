@@ -18,12 +18,12 @@
 
 #include "message-filter-config-manager.h"
 #include "message-processor-private.h"
+#include "plugin-registry-private.h"
 
 #include <QMutex>
 #include <QSet>
 
 #include "ktp-debug.h"
-#include <KServiceTypeTrader>
 
 typedef QSet<KPluginInfo> PluginSet;
 
@@ -33,32 +33,35 @@ class MessageFilterConfigManager::Private
 {
   public:
     Private(MessageFilterConfigManager *parent):
+        registry(new PluginRegistry(QLatin1String("KTpTextUi/MessageFilter"),
+                                    QLatin1String("[X-KTp-PluginInfo-Version] == " KTP_MESSAGE_FILTER_FRAMEWORK_VERSION))),
         q(parent)
     { }
 
+    ~Private()
+    {
+        delete registry;
+    }
+
     PluginSet all;
     PluginSet enabled;
+    PluginSet suspended;
+
+    PluginRegistry *registry;
 
-    KService::List offers() const;
     void generateCache();
 
   private:
     MessageFilterConfigManager *q;
 };
 
-KService::List MessageFilterConfigManager::Private::offers() const
-{
-    return KServiceTypeTrader::self()->query(QLatin1String("KTpTextUi/MessageFilter"),
-                                             QLatin1String("[X-KTp-PluginInfo-Version] == " KTP_MESSAGE_FILTER_FRAMEWORK_VERSION));
-}
-
-
 void MessageFilterConfigManager::Private::generateCache()
 {
-    KPluginInfo::List pluginInfos = KPluginInfo::fromServices(offers(), q->configGroup());
+    KPluginInfo::List pluginInfos = registry->plugins();
     for (KPluginInfo::List::Iterator i = pluginInfos.begin(); i != pluginInfos.end(); i++) {
         KPluginInfo &plugin = *i;
 
+        plugin.setConfig(q->configGroup());
         all.insert(plugin);
 
         plugin.load();
@@ -102,6 +105,21 @@ KPluginInfo::List MessageFilterConfigManager::enabledPlugins() const
     return d->enabled.values();
 }
 
+KPluginInfo::List MessageFilterConfigManager::suspendedPlugins() const
+{
+    return d->suspended.values();
+}
+
+void MessageFilterConfigManager::suspendPlugin(const QString &pluginName)
+{
+    Q_FOREACH (const KPluginInfo &pluginInfo, d->enabled) {
+        if (pluginInfo.pluginName() == pluginName) {
+            d->suspended.insert(pluginInfo);
+            return;
+        }
+    }
+}
+
 KConfigGroup MessageFilterConfigManager::configGroup() const
 {
     return sharedConfig()->group("Plugins");
@@ -114,12 +132,25 @@ KSharedConfig::Ptr MessageFilterConfigManager::sharedConfig() const
 
 void MessageFilterConfigManager::reloadConfig()
 {
+    // filters may provide different scripts and stylesheets with their new configuration
+    MessageProcessor::instance()->d->configChanged();
+    MessageProcessor::instance()->d->loadSettings();
+
     PluginSet::ConstIterator iter = d->all.constBegin();
     for ( ; iter != d->all.constEnd(); ++iter) {
         KPluginInfo pluginInfo = *iter;
 
         const bool wasEnabled = d->enabled.contains(pluginInfo);
 
+        // suspended plugins stay unloaded for the rest of the session
+        if (d->suspended.contains(pluginInfo)) {
+            if (!pluginInfo.isPluginEnabled()) {
+                d->enabled.remove(pluginInfo);
+                d->suspended.remove(pluginInfo);
+            }
+            continue;
+        }
+
         if (!wasEnabled && pluginInfo.isPluginEnabled()) {
             d->enabled.insert(pluginInfo);
             MessageProcessor::instance()->d->loadFilter(pluginInfo);
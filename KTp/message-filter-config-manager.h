@@ -35,6 +35,10 @@ class KTPCOMMONINTERNALS_EXPORT MessageFilterConfigManager
     KPluginInfo::List allPlugins() const;
     KPluginInfo::List enabledPlugins() const;
 
+    /** Enabled plugins which MessageProcessor disabled for this session,
+     *  because their filters repeatedly took longer than the time budget */
+    KPluginInfo::List suspendedPlugins() const;
+
     KConfigGroup       configGroup() const;
     KSharedConfig::Ptr sharedConfig() const;
 
@@ -45,8 +49,12 @@ class KTPCOMMONINTERNALS_EXPORT MessageFilterConfigManager
     ~MessageFilterConfigManager();
 
   private:
+    void suspendPlugin(const QString &pluginName);
+
     class Private;
     Private *d;
+
+    friend class MessageProcessor;
 };
 
 }
@@ -30,11 +30,15 @@ class MessageUrlFilter : public KTp::AbstractMessageFilter
     void filterMessage(KTp::Message &message, const KTp::MessageContext &context) override;
 };
 
-class MessageEscapeFilter : public KTp::AbstractMessageFilter
+// exported for the message pipeline benchmark, so that it measures the filter the library runs;
+// this header is not installed, so it is not part of the API
+class KTPCOMMONINTERNALS_EXPORT MessageEscapeFilter : public KTp::AbstractMessageFilter
 {
   public:
     explicit MessageEscapeFilter(QObject *parent = nullptr);
     void filterMessage(KTp::Message& message, const KTp::MessageContext &context) override;
+    bool isReentrant() const override;
+    bool canProcessInChunks() const override;
 };
 
 #endif
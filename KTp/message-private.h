@@ -19,6 +19,7 @@
 #include "message.h"
 
 #include <QtCore/QSharedData>
+#include <QtCore/QVector>
 
 namespace KTp
 {
@@ -28,16 +29,20 @@ class Message::Private : public QSharedData {
   public:
     Private() :
         QSharedData(),
-        isHistory(false)
+        isHistory(false),
+        deferred(false),
+        partial(false)
     {}
 
     QDateTime   sentTime;
     QString     token;
     Tp::ChannelTextMessageType messageType;
-    QVariantMap properties;
-    QString     mainPart;
-    QStringList parts;
-    QStringList scripts;
+    // mutable ones are filled in by Message::process() on a const message, for all its copies
+    // few per message, so a flat list of (key, value) beats a map
+    mutable QVector<QPair<int, QVariant> > properties;
+    mutable QString     mainPart;
+    mutable QStringList parts;
+    mutable QStringList scripts;
     bool isHistory;
     MessageDirection direction;
 
@@ -45,6 +50,14 @@ class Message::Private : public QSharedData {
     KTp::ContactPtr sender;
     QString senderAlias;
     QString senderId;
+
+    //the filters have yet to run, with this context, see Message::process()
+    mutable bool deferred;
+    mutable Tp::AccountPtr account;
+    mutable Tp::TextChannelPtr channel;
+
+    //only the beginning is processed yet, see MessageProcessor::largeMessageProgress()
+    mutable bool partial;
 };
 
 }
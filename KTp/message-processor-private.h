@@ -17,36 +17,191 @@
 */
 
 #include "message-processor.h"
+#include "abstract-message-filter.h"
+
+#include <QCache>
+#include <QHash>
+#include <QMutex>
+#include <QSet>
+#include <QVector>
+
+class KPluginFactory;
 
 using namespace KTp;
 
 class FilterPlugin
 {
   public:
-    explicit FilterPlugin(const KPluginInfo &pluginInfo, KTp::AbstractMessageFilter *instance);
-    explicit FilterPlugin(const QString &name,  int weight, KTp::AbstractMessageFilter *instance);
+    typedef KTp::AbstractMessageFilter* (*CreateFunction)();
+
+    explicit FilterPlugin(const KPluginInfo &pluginInfo, KPluginFactory *factory, KTp::AbstractMessageFilter *instance);
+    explicit FilterPlugin(const QString &name,  int weight, KTp::AbstractMessageFilter *instance, CreateFunction create);
 
     bool operator<(const FilterPlugin &other) const;
     bool operator==(const FilterPlugin &other) const;
 
+    /** Creates another, parentless instance of the filter, e.g. for a worker thread */
+    KTp::AbstractMessageFilter* createInstance() const;
+
+    /** Whether this is one of our own filters rather than a plugin */
+    bool isBuiltIn() const;
+
     QString name;
     int weight;
     KTp::AbstractMessageFilter* instance;
+    KTp::MessageFilterTriggers triggers;
+
+  private:
+    KPluginFactory *factory;
+    CreateFunction create;
+};
+
+/** Finds out which filters have to run on a message, with a single pass over its text */
+class TriggerScanner
+{
+  public:
+    /** The characters, text and type of one message, to check triggers against */
+    class Scan
+    {
+      public:
+        Scan();
+
+        bool fires(const KTp::MessageFilterTriggers &triggers) const;
+
+      private:
+        bool contains(QChar c) const;
+
+        friend class TriggerScanner;
+
+        // set when no filter has triggers, so that nothing was scanned
+        bool matchAll;
+        // one bit for each Latin-1 character in the text
+        quint32 latin1[8];
+        // trigger characters beyond Latin-1 in the text
+        QSet<QChar> others;
+        QString text;
+        Tp::ChannelTextMessageType type;
+    };
+
+    TriggerScanner();
+    explicit TriggerScanner(const QList<FilterPlugin> &filters);
+
+    Scan scan(const KTp::Message &message) const;
+    QVector<Scan> scan(const QList<KTp::Message> &messages) const;
+
+    /** Runs @p filter on those of @p messages whose @p scans fire @p triggers.
+     *  Returns the number of messages it ran on.*/
+    static int filterMessages(KTp::AbstractMessageFilter *filter, const KTp::MessageFilterTriggers &triggers,
+                              QList<KTp::Message> &messages, const QVector<Scan> &scans,
+                              const KTp::MessageContext &context);
+
+  private:
+    bool m_needed;
+    QSet<QChar> m_otherCharacters;
 };
 
 class MessageProcessor::Private
 {
   public:
     Private(MessageProcessor *parent):
+        headerVersion(0),
+        headerValid(false),
+        timeBudget(0),
+        budgetStrikes(0),
+        configVersion(0),
+        renderCacheHits(0),
+        renderCacheMisses(0),
+        largeMessageThreshold(0),
+        largeMessagePreview(0),
+        largeMessageScheduled(false),
         q(parent)
     { }
 
+    // a very large message being processed a chunk at a time
+    struct LargeMessageJob
+    {
+        LargeMessageJob(const KTp::Message &raw_, const KTp::Message &message_):
+            raw(raw_), message(message_), configVersion(0), position(0)
+        { }
+
+        KTp::Message raw;
+        KTp::Message message;   // the processed chunks are its parts until all are done
+        Tp::AccountPtr account;
+        Tp::TextChannelPtr channel;
+        QByteArray key;
+        int configVersion;      // the one the job started under
+        int position;
+        QString processedPreview;
+        QStringList extraParts; // parts the filters appended
+    };
+
     void loadFilters();
+    void onFilterReady(const KPluginInfo &pluginInfo);
+    /** Blocks until the filters still loading are ready, for results which cannot be redone later */
+    void waitForFilters();
 
     void loadFilter(const KPluginInfo &pluginInfo);
     void unloadFilter(const KPluginInfo &pluginInfo);
 
+    QString buildHeader() const;
+    void invalidateHeader();
+
+    /** To be called whenever filters are loaded or unloaded, or their configuration changes */
+    void configChanged();
+
+    void loadSettings();
+    /** Accounts @p usecs spent by @p plugin on @p messageCount messages. Filters which
+     *  @p blockedGui and keep exceeding the time budget are suspended. */
+    void recordFilterTime(const FilterPlugin &plugin, qint64 usecs, int messageCount, bool blockedGui = true);
+    void suspendFilter(const QString &name);
+
+    void updateTriggerScanner();
+
+    /** Runs every filter whose triggers fire on @p message */
+    void runFilters(KTp::Message &message, const KTp::MessageContext &context);
+
+    /** Whether @p message is long enough to process in chunks, and all filters can */
+    bool isLargeMessage(const KTp::Message &message) const;
+    /** Processes the beginning of @p message now and the rest in chunks while idle */
+    KTp::Message processLargeMessage(const KTp::Message &message, const KTp::MessageContext &context, const QByteArray &key);
+    void processLargeMessageChunk();
+
+    /** Identifies the processed form of a raw @p message under the current configuration */
+    QByteArray renderKey(const KTp::Message &message, const KTp::MessageContext &context) const;
+    /** renderKey() for the messages worth caching one at a time, an empty key otherwise */
+    QByteArray cacheKey(const KTp::Message &message, const KTp::MessageContext &context) const;
+    /** Replaces the content of @p message with the cached processed one, if any. Empty keys are never cached */
+    bool lookupRendered(const QByteArray &key, KTp::Message &message);
+    void insertRendered(const QByteArray &key, const KTp::Message &message);
+
     QList<FilterPlugin> filters;
+    TriggerScanner triggerScanner;
+
+    QString header;
+    int headerVersion;
+    bool headerValid;
+
+    // per message, in microseconds; 0 means no budget
+    qint64 timeBudget;
+    // number of consecutive calls over budget after which a filter is suspended
+    int budgetStrikes;
+
+    mutable QMutex statisticsMutex;
+    QHash<QString, KTp::FilterStatistics> statistics;
+    // calls over budget in a row per filter, reset by any call within budget
+    QHash<QString, int> overBudgetStreaks;
+
+    int configVersion;
+    QCache<QByteArray, KTp::Message> renderCache;
+    quint64 renderCacheHits;
+    quint64 renderCacheMisses;
+
+    // in characters, 0 disables processing large messages in chunks
+    int largeMessageThreshold;
+    int largeMessagePreview;
+    // processed round robin, so one huge message does not hold up the others
+    QList<LargeMessageJob> largeMessages;
+    bool largeMessageScheduled;
 
   private:
     MessageProcessor *q;
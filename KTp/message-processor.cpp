@@ -19,11 +19,21 @@
 
 #include "message-processor.h"
 #include "message-processor-private.h"
+#include "message-private.h"
 #include "message-filters-private.h"
 #include "message-filter-config-manager.h"
+#include "pending-message-processing.h"
+#include "plugin-registry-private.h"
 
+#include <QCryptographicHash>
+#include <QDBusAbstractAdaptor>
+#include <QDBusConnection>
+#include <QElapsedTimer>
 #include <QMutex>
 #include <QStringBuilder>
+#include <QTimer>
+
+#include <cstring>
 
 #include "ktp-debug.h"
 #include <KService>
@@ -33,24 +43,166 @@ Q_LOGGING_CATEGORY(KTP_MESSAGEPROCESSOR, "ktp-message-processor")
 
 using namespace KTp;
 
-FilterPlugin::FilterPlugin(const KPluginInfo &pluginInfo, KTp::AbstractMessageFilter *instance_):
+static KTp::AbstractMessageFilter* createMessageEscapeFilter()
+{
+    return new MessageEscapeFilter();
+}
+
+// Number of messages handed to the filters at once by processIncomingMessages()
+static const int BatchChunkSize = 100;
+
+// Number of latency buckets in FilterStatistics::histogram
+static const int HistogramBuckets = 22;
+
+// Number of characters of a large message processed at a time
+static const int LargeMessageChunkSize = 16 * 1024;
+
+// Whether a chunk of a large message can end right before @p i: after a line break,
+// or after a single space between two words, see AbstractMessageFilter::canProcessInChunks()
+static bool isChunkBoundary(const QString &text, int i)
+{
+    if (text.at(i).isSpace()) {
+        return false;
+    }
+    return text.at(i - 1) == QLatin1Char('\n')
+            || (i > 1 && text.at(i - 1) == QLatin1Char(' ') && !text.at(i - 2).isSpace());
+}
+
+// Where to end a chunk of a large message starting at @p from, close to @p limit.
+// Looks back up to half the chunk for a line break, then for a single space. Failing
+// that the chunk gets longer up to the next boundary, a text without any is not split
+static int chunkEnd(const QString &text, int from, int limit)
+{
+    if (limit >= text.size()) {
+        return text.size();
+    }
+
+    const int lowest = from + (limit - from) / 2;
+    for (int i = limit; i > lowest; --i) {
+        if (text.at(i - 1) == QLatin1Char('\n') && !text.at(i).isSpace()) {
+            return i;
+        }
+    }
+    for (int i = limit; i > lowest; --i) {
+        if (isChunkBoundary(text, i)) {
+            return i;
+        }
+    }
+    for (int i = limit + 1; i < text.size(); ++i) {
+        if (isChunkBoundary(text, i)) {
+            return i;
+        }
+    }
+    return text.size();
+}
+
+/* Optional D-Bus interface for looking at filter performance in a running client,
+ * registered when KTP_MESSAGE_FILTER_DEBUG is set in the environment */
+class MessageProcessorDebugAdaptor : public QDBusAbstractAdaptor
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.kde.KTp.MessageProcessorDebug")
+
+  public:
+    explicit MessageProcessorDebugAdaptor(MessageProcessor *processor):
+        QDBusAbstractAdaptor(processor),
+        m_processor(processor)
+    { }
+
+  public Q_SLOTS:
+    QString filterStatistics() const;
+    void resetFilterStatistics();
+
+  private:
+    MessageProcessor *m_processor;
+};
+
+QString MessageProcessorDebugAdaptor::filterStatistics() const
+{
+    QString out;
+    Q_FOREACH (const KTp::FilterStatistics &stats, m_processor->filterStatistics()) {
+        QStringList histogram;
+        Q_FOREACH (quint64 count, stats.histogram) {
+            histogram << QString::number(count);
+        }
+
+        out += QString::fromLatin1("%1: calls=%2 messages=%3 total=%4us max=%5us overBudget=%6%7 histogram=[%8]\n")
+                   .arg(stats.name)
+                   .arg(stats.calls)
+                   .arg(stats.messages)
+                   .arg(stats.totalTime)
+                   .arg(stats.maxTime)
+                   .arg(stats.overBudget)
+                   .arg(stats.suspended ? QLatin1String(" suspended") : QLatin1String(""))
+                   .arg(histogram.join(QLatin1Char(' ')));
+    }
+
+    const KTp::RenderCacheStatistics cache = m_processor->renderCacheStatistics();
+    out += QString::fromLatin1("render cache: hits=%1 misses=%2 entries=%3 size=%4/%5 bytes\n")
+               .arg(cache.hits)
+               .arg(cache.misses)
+               .arg(cache.entries)
+               .arg(cache.size)
+               .arg(cache.capacity);
+    return out;
+}
+
+void MessageProcessorDebugAdaptor::resetFilterStatistics()
+{
+    m_processor->resetFilterStatistics();
+}
+
+FilterStatistics::FilterStatistics():
+    calls(0),
+    messages(0),
+    totalTime(0),
+    maxTime(0),
+    overBudget(0),
+    suspended(false),
+    histogram(HistogramBuckets, 0)
+{
+}
+
+FilterPlugin::FilterPlugin(const KPluginInfo &pluginInfo, KPluginFactory *factory_, KTp::AbstractMessageFilter *instance_):
     name(pluginInfo.pluginName()),
-    instance(instance_)
+    instance(instance_),
+    triggers(instance_->triggers()),
+    factory(factory_),
+    create(nullptr)
 {
     bool ok;
-    weight = pluginInfo.service()->property(QLatin1String("X-KDE-PluginInfo-Weight"), QVariant::Int).toInt(&ok);
+    weight = pluginInfo.property(QLatin1String("X-KDE-PluginInfo-Weight")).toInt(&ok);
     if (!ok) {
         weight = 100;
     }
 }
 
-FilterPlugin::FilterPlugin(const QString &name_, int weight_, KTp::AbstractMessageFilter *instance_):
+FilterPlugin::FilterPlugin(const QString &name_, int weight_, KTp::AbstractMessageFilter *instance_, CreateFunction create_):
     name(name_),
     weight(weight_),
-    instance(instance_)
+    instance(instance_),
+    triggers(instance_->triggers()),
+    factory(nullptr),
+    create(create_)
 {
 }
 
+KTp::AbstractMessageFilter* FilterPlugin::createInstance() const
+{
+    if (factory) {
+        return factory->create<AbstractMessageFilter>();
+    }
+    if (create) {
+        return create();
+    }
+    return nullptr;
+}
+
+bool FilterPlugin::isBuiltIn() const
+{
+    return factory == nullptr;
+}
+
 bool FilterPlugin::operator<(const FilterPlugin &other) const
 {
     return weight < other.weight;
@@ -63,25 +215,166 @@ bool FilterPlugin::operator==(const FilterPlugin &other) const
            weight == other.weight;
 }
 
-void MessageProcessor::Private::loadFilter(const KPluginInfo &pluginInfo)
+TriggerScanner::Scan::Scan():
+    matchAll(true),
+    type(Tp::ChannelTextMessageTypeNormal)
+{
+    memset(latin1, 0, sizeof(latin1));
+}
+
+bool TriggerScanner::Scan::contains(QChar c) const
+{
+    const ushort u = c.unicode();
+    if (u < 256) {
+        return latin1[u >> 5] & (1u << (u & 31));
+    }
+    return others.contains(c);
+}
+
+bool TriggerScanner::Scan::fires(const KTp::MessageFilterTriggers &triggers) const
+{
+    if (matchAll || triggers.isEmpty()) {
+        return true;
+    }
+
+    if (triggers.messageTypes.contains(type)) {
+        return true;
+    }
+
+    Q_FOREACH (const QChar c, triggers.characters) {
+        if (contains(c)) {
+            return true;
+        }
+    }
+
+    // the text can only contain a substring if it contains its first character
+    Q_FOREACH (const QString &substring, triggers.substrings) {
+        if (!substring.isEmpty() && contains(substring.at(0)) && text.contains(substring)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+TriggerScanner::TriggerScanner():
+    m_needed(false)
 {
-    KService::Ptr service = pluginInfo.service();
+}
 
-    KPluginFactory *factory = KPluginLoader(service->library()).factory();
+TriggerScanner::TriggerScanner(const QList<FilterPlugin> &filters):
+    m_needed(false)
+{
+    Q_FOREACH (const FilterPlugin &plugin, filters) {
+        if (plugin.triggers.isEmpty()) {
+            continue;
+        }
+        m_needed = true;
+
+        Q_FOREACH (const QChar c, plugin.triggers.characters) {
+            if (c.unicode() >= 256) {
+                m_otherCharacters.insert(c);
+            }
+        }
+        Q_FOREACH (const QString &substring, plugin.triggers.substrings) {
+            if (!substring.isEmpty() && substring.at(0).unicode() >= 256) {
+                m_otherCharacters.insert(substring.at(0));
+            }
+        }
+    }
+}
+
+TriggerScanner::Scan TriggerScanner::scan(const KTp::Message &message) const
+{
+    Scan scan;
+    if (!m_needed) {
+        return scan;
+    }
+
+    scan.matchAll = false;
+    scan.text = message.mainMessagePart();
+    scan.type = message.type();
+
+    // Only a table update per character for the common case, this runs over every message
+    const QChar *c = scan.text.constData();
+    const QChar *end = c + scan.text.size();
+    for ( ; c != end; ++c) {
+        const ushort u = c->unicode();
+        if (u < 256) {
+            scan.latin1[u >> 5] |= 1u << (u & 31);
+        } else if (!m_otherCharacters.isEmpty() && m_otherCharacters.contains(*c)) {
+            scan.others.insert(*c);
+        }
+    }
+
+    return scan;
+}
+
+QVector<TriggerScanner::Scan> TriggerScanner::scan(const QList<KTp::Message> &messages) const
+{
+    QVector<Scan> scans;
+    scans.reserve(messages.size());
+    Q_FOREACH (const KTp::Message &message, messages) {
+        scans << scan(message);
+    }
+    return scans;
+}
+
+int TriggerScanner::filterMessages(KTp::AbstractMessageFilter *filter, const KTp::MessageFilterTriggers &triggers,
+                                   QList<KTp::Message> &messages, const QVector<Scan> &scans,
+                                   const KTp::MessageContext &context)
+{
+    QList<int> rows;
+    for (int i = 0; i < messages.size(); ++i) {
+        if (scans.at(i).fires(triggers)) {
+            rows << i;
+        }
+    }
+
+    if (rows.size() == messages.size()) {
+        filter->filterMessages(messages, context);
+    } else if (!rows.isEmpty()) {
+        QList<KTp::Message> triggered;
+        triggered.reserve(rows.size());
+        Q_FOREACH (int row, rows) {
+            triggered << messages.at(row);
+        }
+
+        filter->filterMessages(triggered, context);
+
+        for (int i = 0; i < rows.size(); ++i) {
+            messages[rows.at(i)] = triggered.at(i);
+        }
+    }
+
+    return rows.size();
+}
+
+void MessageProcessor::Private::updateTriggerScanner()
+{
+    triggerScanner = TriggerScanner(filters);
+}
+
+void MessageProcessor::Private::loadFilter(const KPluginInfo &pluginInfo)
+{
+    KPluginFactory *factory = KPluginLoader(pluginInfo.libraryPath()).factory();
     if (factory) {
         qCDebug(KTP_MESSAGEPROCESSOR) << "loaded factory :" << factory;
         AbstractMessageFilter *filter = factory->create<AbstractMessageFilter>(q);
 
         if (filter) {
             qCDebug(KTP_MESSAGEPROCESSOR) << "loaded message filter : " << filter;
-            filters << FilterPlugin(pluginInfo, filter);
+            filters << FilterPlugin(pluginInfo, factory, filter);
         }
     } else {
-        qCWarning(KTP_MESSAGEPROCESSOR) << "error loading plugin :" << service->library();
+        qCWarning(KTP_MESSAGEPROCESSOR) << "error loading plugin :" << pluginInfo.libraryPath();
     }
 
     // Re-sort filters by weight
     std::sort(filters.begin(), filters.end());
+
+    configChanged();
+    updateTriggerScanner();
 }
 
 void MessageProcessor::Private::unloadFilter(const KPluginInfo &pluginInfo)
@@ -94,19 +387,237 @@ void MessageProcessor::Private::unloadFilter(const KPluginInfo &pluginInfo)
             qCDebug(KTP_MESSAGEPROCESSOR) << "unloading message filter : " << plugin.instance;
             plugin.instance->deleteLater();
             filters.erase(iter);
+            configChanged();
+            updateTriggerScanner();
             return;
         }
     }
 }
 
+void MessageProcessor::Private::loadSettings()
+{
+    const KConfigGroup group = MessageFilterConfigManager::self()->sharedConfig()->group("MessageFilters");
+    timeBudget = group.readEntry("timeBudget", 250) * 1000;
+    budgetStrikes = qMax(1, group.readEntry("timeBudgetStrikes", 3));
+    renderCache.setMaxCost(qMax(0, group.readEntry("renderCacheSize", 8192)) * 1024);
+    largeMessageThreshold = qMax(0, group.readEntry("largeMessageThreshold", 256 * 1024));
+    largeMessagePreview = qBound(1024, group.readEntry("largeMessagePreview", 8 * 1024), LargeMessageChunkSize);
+}
+
+bool MessageProcessor::Private::isLargeMessage(const KTp::Message &message) const
+{
+    if (largeMessageThreshold <= 0 || message.d->mainPart.size() <= largeMessageThreshold) {
+        return false;
+    }
+
+    // a single filter which needs to see the whole text is enough to not cut it
+    Q_FOREACH (const FilterPlugin &plugin, filters) {
+        if (!plugin.instance->canProcessInChunks()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+KTp::Message MessageProcessor::Private::processLargeMessage(const KTp::Message &message, const KTp::MessageContext &context, const QByteArray &key)
+{
+    const QString &text = message.d->mainPart;
+    qCDebug(KTP_MESSAGEPROCESSOR) << "processing a message of" << text.size() << "characters in chunks";
+
+    KTp::Message preview = message;
+    const int previewEnd = chunkEnd(text, 0, largeMessagePreview);
+    preview.d->mainPart = text.left(previewEnd);
+    runFilters(preview, context);
+
+    // nowhere to cut it, so that was all of it
+    if (previewEnd == text.size()) {
+        insertRendered(key, preview);
+        return preview;
+    }
+
+    LargeMessageJob job(message, preview);
+    job.account = context.account();
+    job.channel = context.channel();
+    job.key = key;
+    job.configVersion = configVersion;
+    job.position = previewEnd;
+    job.processedPreview = preview.d->mainPart;
+
+    // the parts are the processed chunks until the end, filters' parts come after them
+    job.extraParts = preview.d->parts;
+    job.message.d->parts.clear();
+    job.message.d->partial = true;
+    largeMessages << job;
+
+    if (!largeMessageScheduled) {
+        largeMessageScheduled = true;
+        QTimer::singleShot(0, q, [=]() {
+            processLargeMessageChunk();
+        });
+    }
+
+    return job.message;
+}
+
+void MessageProcessor::Private::processLargeMessageChunk()
+{
+    largeMessageScheduled = false;
+    if (largeMessages.isEmpty()) {
+        return;
+    }
+
+    LargeMessageJob job = largeMessages.takeFirst();
+    const QString &text = job.raw.d->mainPart;
+    const int end = chunkEnd(text, job.position, job.position + LargeMessageChunkSize);
+
+    // each chunk goes through the filters as a message of its own
+    KTp::Message chunk = job.raw;
+    chunk.d->mainPart = text.mid(job.position, end - job.position);
+    chunk.d->parts.clear();
+    chunk.d->scripts.clear();
+    chunk.d->properties.clear();
+    runFilters(chunk, KTp::MessageContext(job.account, job.channel));
+
+    job.message.d->parts << chunk.d->mainPart;
+    job.extraParts << chunk.d->parts;
+    Q_FOREACH (const QString &script, chunk.d->scripts) {
+        if (!job.message.d->scripts.contains(script)) {
+            job.message.d->scripts << script;
+        }
+    }
+
+    // lists, like the urls of the escape filter, add up over the chunks
+    typedef QPair<int, QVariant> Property;
+    Q_FOREACH (const Property &property, chunk.d->properties) {
+        const QVariant previous = job.message.property(property.first);
+        if (previous.type() == QVariant::List && property.second.type() == QVariant::List) {
+            job.message.setProperty(property.first, previous.toList() + property.second.toList());
+        } else {
+            job.message.setProperty(property.first, property.second);
+        }
+    }
+
+    job.position = end;
+
+    if (job.position < text.size()) {
+        Q_EMIT q->largeMessageProgress(job.message, job.position, text.size());
+        largeMessages << job;
+    } else {
+        // one string again, now that nothing is appended anymore
+        job.message.d->mainPart = job.processedPreview + job.message.d->parts.join(QString());
+        job.message.d->parts = job.extraParts;
+        job.message.d->partial = false;
+
+        // rendered with filters which are no longer loaded or configured like this
+        if (job.configVersion == configVersion) {
+            insertRendered(job.key, job.message);
+        }
+        Q_EMIT q->largeMessageProgress(job.message, text.size(), text.size());
+    }
+
+    if (!largeMessages.isEmpty() && !largeMessageScheduled) {
+        largeMessageScheduled = true;
+        QTimer::singleShot(0, q, [=]() {
+            processLargeMessageChunk();
+        });
+    }
+}
+
+void MessageProcessor::Private::recordFilterTime(const FilterPlugin &plugin, qint64 usecs, int messageCount, bool blockedGui)
+{
+    const qint64 perMessage = usecs / qMax(1, messageCount);
+
+    int bucket = 0;
+    while (bucket < HistogramBuckets - 1 && (Q_INT64_C(1) << bucket) <= perMessage) {
+        bucket++;
+    }
+
+    bool suspend = false;
+    {
+        QMutexLocker locker(&statisticsMutex);
+        KTp::FilterStatistics &stats = statistics[plugin.name];
+        stats.name = plugin.name;
+        stats.calls++;
+        stats.messages += messageCount;
+        stats.totalTime += usecs;
+        stats.maxTime = qMax(stats.maxTime, perMessage);
+        stats.histogram[bucket]++;
+
+        if (timeBudget > 0 && perMessage > timeBudget) {
+            stats.overBudget++;
+            const int streak = ++overBudgetStreaks[plugin.name];
+            qCWarning(KTP_MESSAGEPROCESSOR) << "filter" << plugin.name << "took" << perMessage << "us per message";
+
+            // Only filters which are slow time after time and block the GUI thread while at it
+            // are worth disabling, an occasional hiccup over a long session is not.
+            // Never our own filters though, the escape filter is what keeps messages safe to display
+            suspend = blockedGui && streak >= budgetStrikes
+                    && !stats.suspended && !plugin.isBuiltIn();
+            if (suspend) {
+                stats.suspended = true;
+            }
+        } else {
+            overBudgetStreaks.remove(plugin.name);
+        }
+    }
+
+    if (suspend) {
+        suspendFilter(plugin.name);
+    }
+}
+
+void MessageProcessor::Private::suspendFilter(const QString &name)
+{
+    QList<FilterPlugin>::Iterator iter = filters.begin();
+    for ( ; iter != filters.end(); ++iter) {
+        if (iter->name == name) {
+            qCWarning(KTP_MESSAGEPROCESSOR) << "disabling message filter" << name << "for this session, it is too slow";
+            iter->instance->deleteLater();
+            filters.erase(iter);
+            configChanged();
+            updateTriggerScanner();
+            break;
+        }
+    }
+
+    MessageFilterConfigManager::self()->suspendPlugin(name);
+}
+
 void MessageProcessor::Private::loadFilters()
 {
     qCDebug(KTP_MESSAGEPROCESSOR) << "Starting loading filters...";
 
-    KPluginInfo::List plugins = MessageFilterConfigManager::self()->enabledPlugins();
+    // The plugin libraries are loaded on worker threads, meanwhile messages
+    // are processed with the filters which are ready already
+    PluginRegistry *registry = MessageFilterConfigManager::self()->d->registry;
+    QObject::connect(registry, &PluginRegistry::pluginReady, q, [=](const KPluginInfo &pluginInfo) {
+        onFilterReady(pluginInfo);
+    });
+
+    registry->preload(MessageFilterConfigManager::self()->enabledPlugins());
+}
+
+void MessageProcessor::Private::onFilterReady(const KPluginInfo &pluginInfo)
+{
+    // it may have been disabled or loaded by reloadConfig() in the meantime
+    MessageFilterConfigManager *manager = MessageFilterConfigManager::self();
+    if (!manager->enabledPlugins().contains(pluginInfo) || manager->suspendedPlugins().contains(pluginInfo)) {
+        return;
+    }
+    Q_FOREACH (const FilterPlugin &plugin, filters) {
+        if (plugin.name == pluginInfo.pluginName()) {
+            return;
+        }
+    }
+
+    loadFilter(pluginInfo);
+}
 
-    Q_FOREACH (const KPluginInfo &plugin, plugins) {
-        loadFilter(plugin);
+void MessageProcessor::Private::waitForFilters()
+{
+    PluginRegistry *registry = MessageFilterConfigManager::self()->d->registry;
+    if (registry->isPreloading()) {
+        registry->waitForPreloaded();
     }
 }
 
@@ -131,9 +642,16 @@ MessageProcessor::MessageProcessor():
     // which don't have weight specified and in this exact order.
     //
     // The escape filter also has the URL filter in it, see message-escape-filter.cpp for details
-    d->filters << FilterPlugin(QLatin1String("__messageEscapeFilter"), 98, new MessageEscapeFilter(this));
+    d->filters << FilterPlugin(QLatin1String("__messageEscapeFilter"), 98, new MessageEscapeFilter(this), createMessageEscapeFilter);
 
     d->loadFilters();
+    d->updateTriggerScanner();
+    d->loadSettings();
+
+    if (qEnvironmentVariableIsSet("KTP_MESSAGE_FILTER_DEBUG")) {
+        new MessageProcessorDebugAdaptor(this);
+        QDBusConnection::sessionBus().registerObject(QLatin1String("/org/kde/KTp/MessageProcessor"), this);
+    }
 }
 
 
@@ -142,11 +660,107 @@ MessageProcessor::~MessageProcessor()
     delete d;
 }
 
-QString MessageProcessor::header()
+void MessageProcessor::Private::invalidateHeader()
+{
+    headerValid = false;
+}
+
+void MessageProcessor::Private::configChanged()
+{
+    invalidateHeader();
+
+    // entries of messages still being processed with the old configuration will carry the old version
+    configVersion++;
+    renderCache.clear();
+}
+
+QByteArray MessageProcessor::Private::renderKey(const KTp::Message &message, const KTp::MessageContext &context) const
+{
+    QByteArray key = QByteArray::number(configVersion);
+    key += '/';
+    if (context.account()) {
+        key += context.account()->uniqueIdentifier().toUtf8();
+    }
+    key += '/';
+    // filters may render the same text differently per conversation
+    if (context.channel()) {
+        key += context.channel()->targetId().toUtf8();
+    }
+    key += '/';
+    key += QByteArray::number(message.direction());
+    key += message.isHistory() ? "/h/" : "/l/";
+
+    // tokens are not guaranteed to be unique, nor to exist at all, so the content always counts
+    if (message.token().isEmpty()) {
+        key += QByteArray::number(message.time().toMSecsSinceEpoch());
+        key += '/';
+        key += message.senderId().toUtf8();
+        key += '/';
+        key += QByteArray::number(message.type());
+    } else {
+        key += message.token().toUtf8();
+    }
+    key += '/';
+    // a digest rather than qHash(), a collision would show one message's content in place of another's
+    key += QCryptographicHash::hash(message.mainMessagePart().toUtf8(), QCryptographicHash::Sha1);
+
+    return key;
+}
+
+QByteArray MessageProcessor::Private::cacheKey(const KTp::Message &message, const KTp::MessageContext &context) const
+{
+    // Live messages are shown once, and come back from the logs as history with another key.
+    // Caching them would only cost a digest of each and push out history worth keeping
+    if (!message.isHistory()) {
+        return QByteArray();
+    }
+    return renderKey(message, context);
+}
+
+bool MessageProcessor::Private::lookupRendered(const QByteArray &key, KTp::Message &message)
+{
+    if (key.isEmpty()) {
+        return false;
+    }
+
+    const KTp::Message *cached = renderCache.object(key);
+    if (!cached) {
+        renderCacheMisses++;
+        return false;
+    }
+
+    renderCacheHits++;
+    message.d->mainPart = cached->d->mainPart;
+    message.d->parts = cached->d->parts;
+    message.d->scripts = cached->d->scripts;
+    message.d->properties = cached->d->properties;
+    return true;
+}
+
+void MessageProcessor::Private::insertRendered(const QByteArray &key, const KTp::Message &message)
+{
+    if (key.isEmpty()) {
+        return;
+    }
+
+    // a rough estimate of the memory held by the entry
+    int cost = key.size() + 128 + message.d->mainPart.size() * 2;
+    Q_FOREACH (const QString &part, message.d->parts) {
+        cost += part.size() * 2;
+    }
+    Q_FOREACH (const QString &script, message.d->scripts) {
+        cost += script.size() * 2;
+    }
+    cost += message.d->properties.size() * 64;
+
+    renderCache.insert(key, new KTp::Message(message), cost);
+}
+
+QString MessageProcessor::Private::buildHeader() const
 {
     QStringList scripts;
     QStringList stylesheets;
-    Q_FOREACH (const FilterPlugin &plugin, d->filters) {
+    Q_FOREACH (const FilterPlugin &plugin, filters) {
         Q_FOREACH (const QString &script, plugin.instance->requiredScripts()) {
             // Avoid duplicates
             if (!scripts.contains(script)) {
@@ -178,6 +792,37 @@ QString MessageProcessor::header()
     return out;
 }
 
+QString MessageProcessor::header()
+{
+    // Chat views fetch it once, the scripts and stylesheets of filters still
+    // loading would be missing for good while their markup shows up later
+    d->waitForFilters();
+
+    // Building the header means asking every filter and looking up every file,
+    // so only do it again after the set of filters or their configuration changed
+    if (!d->headerValid) {
+        const QString header = d->buildHeader();
+        if (header != d->header) {
+            d->header = header;
+            d->headerVersion++;
+        }
+        d->headerValid = true;
+    }
+
+    return d->header;
+}
+
+int MessageProcessor::headerVersion()
+{
+    header();
+    return d->headerVersion;
+}
+
+bool MessageProcessor::headerChangedSince(int version)
+{
+    return headerVersion() != version;
+}
+
 KTp::Message MessageProcessor::processIncomingMessage(const Tp::Message &message, const Tp::AccountPtr &account, const Tp::TextChannelPtr &channel)
 {
     KTp::MessageContext context(account, channel);
@@ -192,22 +837,215 @@ KTp::Message KTp::MessageProcessor::processIncomingMessage(const Tp::ReceivedMes
 
 KTp::Message MessageProcessor::processIncomingMessage(KTp::Message message, const KTp::MessageContext &context)
 {
-    Q_FOREACH (const FilterPlugin &plugin, d->filters) {
+    // it is being processed right now
+    if (message.isDeferred()) {
+        message.d->deferred = false;
+    }
+
+    const QByteArray key = d->cacheKey(message, context);
+    if (d->lookupRendered(key, message)) {
+        return message;
+    }
+
+    d->runFilters(message, context);
+
+    d->insertRendered(key, message);
+    return message;
+}
+
+KTp::Message MessageProcessor::processIncomingMessageInChunks(KTp::Message message, const KTp::MessageContext &context)
+{
+    if (!d->isLargeMessage(message)) {
+        return processIncomingMessage(message, context);
+    }
+
+    // it is being processed right now
+    if (message.isDeferred()) {
+        message.d->deferred = false;
+    }
+
+    const QByteArray key = d->cacheKey(message, context);
+    if (d->lookupRendered(key, message)) {
+        return message;
+    }
+
+    return d->processLargeMessage(message, context, key);
+}
+
+void MessageProcessor::Private::runFilters(KTp::Message &message, const KTp::MessageContext &context)
+{
+    const TriggerScanner::Scan scan = triggerScanner.scan(message);
+
+    QElapsedTimer timer;
+    Q_FOREACH (const FilterPlugin &plugin, filters) {
+        if (!scan.fires(plugin.triggers)) {
+            continue;
+        }
         qCDebug(KTP_MESSAGEPROCESSOR) << "running filter:" << plugin.instance->metaObject()->className();
+        timer.start();
         plugin.instance->filterMessage(message, context);
+        recordFilterTime(plugin, timer.nsecsElapsed() / 1000, 1);
+    }
+}
+
+QList<KTp::Message> MessageProcessor::processIncomingMessages(QList<KTp::Message> messages, const KTp::MessageContext &context)
+{
+    const int total = messages.size();
+
+    // only the messages which are not cached yet need the filters
+    QVector<QByteArray> keys;
+    keys.reserve(total);
+    QList<int> pending;
+    for (int i = 0; i < total; ++i) {
+        if (messages.at(i).isDeferred()) {
+            messages[i].d->deferred = false;
+        }
+
+        keys << d->renderKey(messages.at(i), context);
+        if (d->lookupRendered(keys.last(), messages[i])) {
+            continue;
+        }
+
+        pending << i;
+    }
+
+    // Hand the batch to the filters in chunks, so that they can share their setup cost
+    // across many messages, while large batches can still report their progress.
+    const int cached = total - pending.size();
+    for (int first = 0; first < pending.size(); first += BatchChunkSize) {
+        const QList<int> rows = pending.mid(first, BatchChunkSize);
+        QList<KTp::Message> chunk;
+        chunk.reserve(rows.size());
+        Q_FOREACH (int row, rows) {
+            chunk << messages.at(row);
+        }
+        const QVector<TriggerScanner::Scan> scans = d->triggerScanner.scan(chunk);
+
+        QElapsedTimer timer;
+        Q_FOREACH (const FilterPlugin &plugin, d->filters) {
+            qCDebug(KTP_MESSAGEPROCESSOR) << "running filter on" << chunk.size() << "messages:" << plugin.instance->metaObject()->className();
+            timer.start();
+            const int filtered = TriggerScanner::filterMessages(plugin.instance, plugin.triggers, chunk, scans, context);
+            if (filtered > 0) {
+                d->recordFilterTime(plugin, timer.nsecsElapsed() / 1000, filtered);
+            }
+        }
+
+        for (int i = 0; i < chunk.size(); ++i) {
+            messages[rows.at(i)] = chunk.at(i);
+            d->insertRendered(keys.at(rows.at(i)), chunk.at(i));
+        }
+
+        if (pending.size() > BatchChunkSize) {
+            Q_EMIT batchProgress(cached + qMin(first + BatchChunkSize, pending.size()), total);
+        }
     }
+
+    return messages;
+}
+
+KTp::PendingMessageProcessing* MessageProcessor::processIncomingMessagesAsync(const QList<KTp::Message> &messages, const KTp::MessageContext &context)
+{
+    // the workers must not try to process deferred messages on their own
+    QList<KTp::Message> processing = messages;
+    for (int i = 0; i < processing.size(); ++i) {
+        if (processing.at(i).isDeferred()) {
+            processing[i].d->deferred = false;
+        }
+    }
+
+    return new PendingMessageProcessing(processing, context, this);
+}
+
+KTp::Message MessageProcessor::deferIncomingMessage(const Tp::Message &message, const Tp::AccountPtr &account, const Tp::TextChannelPtr &channel)
+{
+    KTp::MessageContext context(account, channel);
+    return deferIncomingMessage(KTp::Message(message, context), context);
+}
+
+KTp::Message MessageProcessor::deferIncomingMessage(const Tp::ReceivedMessage &message, const Tp::AccountPtr &account, const Tp::TextChannelPtr &channel)
+{
+    KTp::MessageContext context(account, channel);
+    return deferIncomingMessage(KTp::Message(message, context), context);
+}
+
+KTp::Message MessageProcessor::deferIncomingMessage(KTp::Message message, const KTp::MessageContext &context)
+{
+    message.d->deferred = true;
+    message.d->account = context.account();
+    message.d->channel = context.channel();
     return message;
 }
 
+QList<KTp::Message> MessageProcessor::deferIncomingMessages(QList<KTp::Message> messages, const KTp::MessageContext &context)
+{
+    for (int i = 0; i < messages.size(); ++i) {
+        messages[i] = deferIncomingMessage(messages.at(i), context);
+    }
+    return messages;
+}
+
 KTp::OutgoingMessage MessageProcessor::processOutgoingMessage(const QString &messageText, const Tp::AccountPtr &account, const Tp::TextChannelPtr &channel)
 {
+    // what is sent cannot be filtered again once the remaining filters are ready
+    d->waitForFilters();
+
     KTp::MessageContext context(account, channel);
     KTp::OutgoingMessage message(messageText);
 
+    QElapsedTimer timer;
     Q_FOREACH (const FilterPlugin &plugin, d->filters) {
         qCDebug(KTP_MESSAGEPROCESSOR) << "running outgoing filter: " << plugin.instance->metaObject()->className();
+        timer.start();
         plugin.instance->filterOutgoingMessage(message, context);
+        d->recordFilterTime(plugin, timer.nsecsElapsed() / 1000, 1);
     }
 
     return message;
 }
+
+RenderCacheStatistics::RenderCacheStatistics():
+    hits(0),
+    misses(0),
+    entries(0),
+    size(0),
+    capacity(0)
+{
+}
+
+KTp::RenderCacheStatistics MessageProcessor::renderCacheStatistics() const
+{
+    KTp::RenderCacheStatistics stats;
+    stats.hits = d->renderCacheHits;
+    stats.misses = d->renderCacheMisses;
+    stats.entries = d->renderCache.count();
+    stats.size = d->renderCache.totalCost();
+    stats.capacity = d->renderCache.maxCost();
+    return stats;
+}
+
+void MessageProcessor::clearRenderCache()
+{
+    d->renderCache.clear();
+}
+
+QList<KTp::FilterStatistics> MessageProcessor::filterStatistics() const
+{
+    QMutexLocker locker(&d->statisticsMutex);
+    return d->statistics.values();
+}
+
+void MessageProcessor::resetFilterStatistics()
+{
+    QMutexLocker locker(&d->statisticsMutex);
+    QHash<QString, KTp::FilterStatistics>::Iterator iter = d->statistics.begin();
+    for ( ; iter != d->statistics.end(); ++iter) {
+        // keep remembering which filters are suspended
+        const bool suspended = iter->suspended;
+        *iter = KTp::FilterStatistics();
+        iter->name = iter.key();
+        iter->suspended = suspended;
+    }
+}
+
+#include "message-processor.moc"
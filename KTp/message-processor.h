@@ -23,6 +23,7 @@
 #include <QObject>
 #include <QList>
 #include <QLoggingCategory>
+#include <QVector>
 #include <KPluginInfo>
 
 #include <KTp/message.h>
@@ -44,6 +45,37 @@ namespace KTp
 {
 
 class AbstractMessageFilter;
+class PendingMessageProcessing;
+
+/** Latency counters of a single message filter, see MessageProcessor::filterStatistics() */
+struct KTPCOMMONINTERNALS_EXPORT FilterStatistics
+{
+    FilterStatistics();
+
+    QString name;
+    quint64 calls;         ///< filterMessage(), filterMessages() and filterOutgoingMessage() calls
+    quint64 messages;      ///< messages processed by these calls
+    qint64 totalTime;      ///< time spent in these calls, in microseconds
+    qint64 maxTime;        ///< highest time per message of a single call, in microseconds
+    quint64 overBudget;    ///< calls which exceeded the time budget per message
+    bool suspended;        ///< disabled for this session after exceeding the budget too often
+
+    /** Calls by time per message: bucket 0 counts calls under 1us, bucket i calls
+     *  from 2^(i-1) to 2^i us, the last bucket all slower calls */
+    QVector<quint64> histogram;
+};
+
+/** State of the cache of processed messages, see MessageProcessor::renderCacheStatistics() */
+struct KTPCOMMONINTERNALS_EXPORT RenderCacheStatistics
+{
+    RenderCacheStatistics();
+
+    quint64 hits;
+    quint64 misses;
+    int entries;
+    int size;       ///< estimated memory use of the entries, in bytes
+    int capacity;   ///< in bytes, least recently used entries are dropped beyond it
+};
 
 //each thing that displays message will have an instance of this
 class KTPCOMMONINTERNALS_EXPORT MessageProcessor : public QObject
@@ -57,6 +89,11 @@ class KTPCOMMONINTERNALS_EXPORT MessageProcessor : public QObject
     //text-ui will call this somewhere when creating the template
     QString header();
 
+    //the header is cached, its version increases each time the header content changes.
+    //clients holding a header can use this to avoid re-injecting identical HTML
+    int headerVersion();
+    bool headerChangedSince(int version);
+
     //text-ui will call this somewhere in handleIncommingMessage just before displaying it
     KTp::Message processIncomingMessage(const Tp::Message &message, const Tp::AccountPtr &account, const Tp::TextChannelPtr &channel);
     KTp::Message processIncomingMessage(const Tp::ReceivedMessage &message, const Tp::AccountPtr &account, const Tp::TextChannelPtr &channel);
@@ -64,6 +101,44 @@ class KTPCOMMONINTERNALS_EXPORT MessageProcessor : public QObject
     KTp::OutgoingMessage processOutgoingMessage(const QString &messageText, const Tp::AccountPtr &account, const Tp::TextChannelPtr &channel);
 
     KTp::Message processIncomingMessage(KTp::Message message, const KTp::MessageContext &context);
+
+    //same as processIncomingMessage(), but a message longer than MessageFilters/largeMessageThreshold
+    //characters in ktelepathyrc is returned with only its beginning processed, see KTp::Message::isPartial(),
+    //and completed through largeMessageProgress(). only for callers which listen to that signal
+    KTp::Message processIncomingMessageInChunks(KTp::Message message, const KTp::MessageContext &context);
+
+    //history and scrollback will call this to process a whole page of messages at once
+    QList<KTp::Message> processIncomingMessages(QList<KTp::Message> messages, const KTp::MessageContext &context);
+
+    //same as processIncomingMessages(), but reentrant filters run on a worker thread.
+    //the returned operation emits finished() on this thread once the messages are ready
+    KTp::PendingMessageProcessing* processIncomingMessagesAsync(const QList<KTp::Message> &messages, const KTp::MessageContext &context);
+
+    //returns the message without running the filters yet, they run the first time its content is needed.
+    //for models which may never show most of their messages, see KTp::Message::process()
+    KTp::Message deferIncomingMessage(const Tp::Message &message, const Tp::AccountPtr &account, const Tp::TextChannelPtr &channel);
+    KTp::Message deferIncomingMessage(const Tp::ReceivedMessage &message, const Tp::AccountPtr &account, const Tp::TextChannelPtr &channel);
+    KTp::Message deferIncomingMessage(KTp::Message message, const KTp::MessageContext &context);
+    QList<KTp::Message> deferIncomingMessages(QList<KTp::Message> messages, const KTp::MessageContext &context);
+
+    //time spent in each filter since startup or the last resetFilterStatistics()
+    QList<KTp::FilterStatistics> filterStatistics() const;
+    void resetFilterStatistics();
+
+    //history messages, and all those processed in batches, are processed once and then served
+    //from a cache shared by the whole process, keyed by their token or content and the filter configuration.
+    //its capacity is MessageFilters/renderCacheSize in ktelepathyrc, in KiB
+    KTp::RenderCacheStatistics renderCacheStatistics() const;
+    void clearRenderCache();
+
+  Q_SIGNALS:
+    //emitted while processIncomingMessages() works through a large batch
+    void batchProgress(int processedMessages, int totalMessages);
+
+    //the rest of a message returned partial by processIncomingMessageInChunks() is processed in chunks
+    //while idle, and each time this delivers the message with more of it processed, the last time complete
+    void largeMessageProgress(const KTp::Message &message, int processedLength, int totalLength);
+
   protected:
     explicit MessageProcessor();
 
@@ -72,6 +147,7 @@ class KTPCOMMONINTERNALS_EXPORT MessageProcessor : public QObject
     Private * const d;
 
     friend class MessageFilterConfigManager;
+    friend class PendingMessageProcessing;
 };
 
 }
@@ -19,8 +19,11 @@
 
 #include "message.h"
 #include "message-private.h"
+#include "message-processor.h"
 
 #include "ktp-debug.h"
+#include <QHash>
+#include <QReadWriteLock>
 #include <QSharedData>
 
 #include <TelepathyQt/ContactManager>
@@ -28,6 +31,61 @@
 
 using namespace KTp;
 
+namespace
+{
+
+// Names of message properties and their keys, shared by the whole process
+class PropertyKeys
+{
+  public:
+    int key(const char *name, bool create);
+    QByteArray name(int key);
+
+  private:
+    QReadWriteLock lock;
+    QHash<QByteArray, int> keys;
+    QList<QByteArray> names;
+};
+
+int PropertyKeys::key(const char *name, bool create)
+{
+    // no copy of the name just to look it up
+    const QByteArray rawName = QByteArray::fromRawData(name, qstrlen(name));
+
+    {
+        QReadLocker locker(&lock);
+        const QHash<QByteArray, int>::ConstIterator it = keys.constFind(rawName);
+        if (it != keys.constEnd()) {
+            return it.value();
+        }
+    }
+
+    if (!create) {
+        return -1;
+    }
+
+    QWriteLocker locker(&lock);
+    const QHash<QByteArray, int>::ConstIterator it = keys.constFind(rawName);
+    if (it != keys.constEnd()) {
+        return it.value();
+    }
+
+    const QByteArray ownName(name);
+    names << ownName;
+    keys.insert(ownName, names.size() - 1);
+    return names.size() - 1;
+}
+
+QByteArray PropertyKeys::name(int key)
+{
+    QReadLocker locker(&lock);
+    return names.value(key);
+}
+
+Q_GLOBAL_STATIC(PropertyKeys, s_propertyKeys)
+
+}
+
 Message& Message::operator=(const Message &other) {
     d = other.d;
     return *this;
@@ -107,21 +165,26 @@ Message::~Message()
 
 QString Message::mainMessagePart() const
 {
+    process();
     return d->mainPart;
 }
 
 void Message::setMainMessagePart(const QString& message)
 {
+    process();
     d->mainPart = message;
 }
 
 void Message::appendMessagePart(const QString& part)
 {
+    process();
     d->parts << part;
 }
 
 void Message::appendScript(const QString& script)
 {
+    process();
+
     // Append the script only if it is not already appended to avoid multiple
     // execution of the scripts.
     if (!d->scripts.contains(script)) {
@@ -131,6 +194,8 @@ void Message::appendScript(const QString& script)
 
 QString Message::finalizedMessage() const
 {
+    process();
+
     QString msg = d->mainPart + QLatin1Char('\n') +
         d->parts.join(QLatin1String("\n"));
 
@@ -140,6 +205,8 @@ QString Message::finalizedMessage() const
 
 QString Message::finalizedScript() const
 {
+    process();
+
     if (d->scripts.empty()) {
         return QString();
     }
@@ -156,12 +223,55 @@ QString Message::finalizedScript() const
 
 QVariant Message::property(const char *name) const
 {
-    return d->properties[QLatin1String(name)];
+    // a property nobody ever set does not need a key
+    const int key = s_propertyKeys->key(name, false);
+    if (key < 0) {
+        process();
+        return QVariant();
+    }
+    return property(key);
 }
 
 void Message::setProperty(const char *name, const QVariant& value)
 {
-    d->properties[QLatin1String(name)] = value;
+    setProperty(s_propertyKeys->key(name, true), value);
+}
+
+int Message::propertyKey(const char *name)
+{
+    return s_propertyKeys->key(name, true);
+}
+
+QByteArray Message::propertyName(int key)
+{
+    return s_propertyKeys->name(key);
+}
+
+QVariant Message::property(int key) const
+{
+    process();
+
+    const QVector<QPair<int, QVariant> > &properties = d->properties;
+    for (int i = 0; i < properties.size(); ++i) {
+        if (properties.at(i).first == key) {
+            return properties.at(i).second;
+        }
+    }
+    return QVariant();
+}
+
+void Message::setProperty(int key, const QVariant &value)
+{
+    process();
+
+    QVector<QPair<int, QVariant> > &properties = d->properties;
+    for (int i = 0; i < properties.size(); ++i) {
+        if (properties.at(i).first == key) {
+            properties[i].second = value;
+            return;
+        }
+    }
+    properties.append(qMakePair(key, value));
 }
 
 QDateTime Message::time() const
@@ -202,6 +312,7 @@ KTp::ContactPtr Message::sender() const
 
 int Message::partsSize() const
 {
+    process();
     return d->parts.size();
 }
 
@@ -215,8 +326,62 @@ KTp::Message::MessageDirection Message::direction() const
     return d->direction;
 }
 
+bool Message::isDeferred() const
+{
+    return d->deferred;
+}
+
+void Message::process() const
+{
+    processDeferred(false);
+}
+
+void Message::processInChunks() const
+{
+    processDeferred(true);
+}
+
+void Message::processDeferred(bool inChunks) const
+{
+    if (!d->deferred) {
+        return;
+    }
+
+    // The result is stored in the shared data, so that every copy of the message
+    // benefits from it, hence the fields involved are mutable rather than detaching.
+    // The filters work on a copy, which detaches once they change it, so they still
+    // see the raw message here and no longer deferred.
+    d->deferred = false;
+
+    const KTp::MessageContext context(d->account, d->channel);
+    KTp::MessageProcessor *processor = KTp::MessageProcessor::instance();
+    const KTp::Message processed = inChunks ? processor->processIncomingMessageInChunks(*this, context)
+                                            : processor->processIncomingMessage(*this, context);
+
+    d->mainPart = processed.d->mainPart;
+    d->parts = processed.d->parts;
+    d->scripts = processed.d->scripts;
+    d->properties = processed.d->properties;
+    d->partial = processed.d->partial;
+    d->account.reset();
+    d->channel.reset();
+}
+
+bool Message::isPartial() const
+{
+    process();
+    return d->partial;
+}
+
 bool KTp::Message::operator==(const KTp::Message &other) const
 {
+    // compare raw messages as they are, rather than processing them just for this
+    if (isDeferred() && other.isDeferred()) {
+        return d->mainPart == other.d->mainPart
+            && time() == other.time()
+            && senderId() == other.senderId();
+    }
+
     return mainMessagePart() == other.mainMessagePart()
         && time() == other.time()
         && senderId() == other.senderId();
@@ -128,6 +128,20 @@ public:
     QVariant property(const char *name) const;
     void setProperty(const char *name, const QVariant &value);
 
+    /*! \brief The key of the property @p name, for property(int) and setProperty(int, const QVariant&)
+     *
+     * \par
+     * Property names are registered once per process and then referred to by
+     * this number, which is much cheaper than passing the name each time.
+     * Filters should look keys up once, e.g. in a function-local static.
+     */
+    static int propertyKey(const char *name);
+    /*! \return the name of the property with key @p key */
+    static QByteArray propertyName(int key);
+
+    QVariant property(int key) const;
+    void setProperty(int key, const QVariant &value);
+
     /*! \return the time the message was sent*/
     QDateTime time() const;
     /*! \return the unique token from the message*/
@@ -153,6 +167,42 @@ public:
 
     MessageDirection direction() const;
 
+    /*! \brief Whether the message filters are still to run on this message
+     *
+     * \par
+     * Messages from MessageProcessor::deferIncomingMessage() are filtered the
+     * first time their content is needed, e.g. by finalizedMessage(), and keep
+     * the result, which all copies of the message share.
+     */
+    bool isDeferred() const;
+
+    /*! \brief Run the deferred message filters now
+     *
+     * \par
+     * Does nothing unless the message isDeferred(). Must be called from the
+     * thread of the MessageProcessor.
+     */
+    void process() const;
+
+    /*! \brief Run the deferred message filters now, a very large message in chunks
+     *
+     * \par
+     * Same as process(), but through MessageProcessor::processIncomingMessageInChunks(),
+     * so a very large message may be left isPartial(). Only for callers which
+     * listen to MessageProcessor::largeMessageProgress().
+     */
+    void processInChunks() const;
+
+    /*! \brief Whether only the beginning of this very large message is processed yet
+     *
+     * \par
+     * Only messages from MessageProcessor::processIncomingMessageInChunks() or
+     * processInChunks() can be partial. MessageProcessor processes the rest in
+     * the background and delivers the message again through
+     * MessageProcessor::largeMessageProgress().
+     */
+    bool isPartial() const;
+
     bool operator==(const KTp::Message &other) const;
 
 protected:
@@ -164,6 +214,9 @@ protected:
 
     QSharedDataPointer<Private> d;
     friend class MessageProcessor;
+
+private:
+    void processDeferred(bool inChunks) const;
 };
 
 }
@@ -0,0 +1,254 @@
+/*
+    Copyright (C) 2026  KDE Telepathy developers
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "pending-message-processing.h"
+#include "message-processor.h"
+#include "message-processor-private.h"
+
+#include <QElapsedTimer>
+#include <QFutureWatcher>
+#include <QThreadStorage>
+#include <QTimer>
+#include <QtConcurrentRun>
+
+#include "ktp-debug.h"
+
+using namespace KTp;
+
+namespace
+{
+
+// Filter instances owned by a worker thread, deleted when the thread exits
+class ThreadFilters
+{
+  public:
+    ThreadFilters():
+        configVersion(-1)
+    { }
+
+    ~ThreadFilters()
+    {
+        qDeleteAll(filters);
+    }
+
+    // the MessageProcessor configuration the instances were created under
+    int configVersion;
+    QHash<QString, KTp::AbstractMessageFilter*> filters;
+};
+
+QThreadStorage<ThreadFilters*> s_threadFilters;
+
+KTp::AbstractMessageFilter *threadFilter(const FilterPlugin &plugin, int configVersion)
+{
+    if (!s_threadFilters.hasLocalData()) {
+        s_threadFilters.setLocalData(new ThreadFilters);
+    }
+
+    // filters were reloaded or reconfigured since, the GUI thread has new instances so we need them too
+    ThreadFilters *threadFilters = s_threadFilters.localData();
+    if (threadFilters->configVersion != configVersion) {
+        qDeleteAll(threadFilters->filters);
+        threadFilters->filters.clear();
+        threadFilters->configVersion = configVersion;
+    }
+
+    QHash<QString, KTp::AbstractMessageFilter*> &filters = threadFilters->filters;
+    QHash<QString, KTp::AbstractMessageFilter*>::iterator it = filters.find(plugin.name);
+    if (it == filters.end()) {
+        it = filters.insert(plugin.name, plugin.createInstance());
+        if (!it.value()) {
+            qCWarning(KTP_MESSAGEPROCESSOR) << "could not create a worker instance of" << plugin.name;
+        }
+    }
+
+    return it.value();
+}
+
+struct WorkerResult
+{
+    QList<KTp::Message> messages;
+    // microseconds spent in each filter of the step, -1 if it did not run
+    QList<qint64> filterTimes;
+    // number of messages each filter ran on
+    QList<int> filterCounts;
+};
+
+WorkerResult runReentrantFilters(const QList<FilterPlugin> &plugins, const QList<KTp::Message> &messages,
+                                 const QVector<TriggerScanner::Scan> &scans,
+                                 const Tp::AccountPtr &account, const Tp::TextChannelPtr &channel,
+                                 int configVersion)
+{
+    const KTp::MessageContext context(account, channel);
+    WorkerResult result;
+    result.messages = messages;
+
+    QElapsedTimer timer;
+    Q_FOREACH (const FilterPlugin &plugin, plugins) {
+        KTp::AbstractMessageFilter *filter = threadFilter(plugin, configVersion);
+        int filtered = 0;
+        if (filter) {
+            timer.start();
+            filtered = TriggerScanner::filterMessages(filter, plugin.triggers, result.messages, scans, context);
+        }
+        result.filterTimes << (filtered > 0 ? timer.nsecsElapsed() / 1000 : -1);
+        result.filterCounts << filtered;
+    }
+
+    return result;
+}
+
+}
+
+class PendingMessageProcessing::Private
+{
+  public:
+    Private():
+        configVersion(0),
+        nextStep(0)
+    { }
+
+    // all messages, those served from the render cache already processed
+    QList<KTp::Message> results;
+    // the messages to filter, their rows in results and their render cache keys
+    QList<KTp::Message> messages;
+    QList<int> rows;
+    QList<QByteArray> keys;
+    QVector<TriggerScanner::Scan> scans;
+    Tp::AccountPtr account;
+    Tp::TextChannelPtr channel;
+    // MessageProcessor's when the operation started
+    int configVersion;
+
+    // consecutive filters with the same reentrancy, in filter order
+    QList<QList<FilterPlugin> > steps;
+    QList<bool> stepIsReentrant;
+    int nextStep;
+
+    QFutureWatcher<WorkerResult> watcher;
+};
+
+PendingMessageProcessing::PendingMessageProcessing(const QList<KTp::Message> &messages, const KTp::MessageContext &context, QObject *parent):
+    QObject(parent),
+    d(new Private)
+{
+    d->results = messages;
+    d->account = context.account();
+    d->channel = context.channel();
+
+    MessageProcessor::Private *processor = MessageProcessor::instance()->d;
+    d->configVersion = processor->configVersion;
+    for (int i = 0; i < d->results.size(); ++i) {
+        const QByteArray key = processor->renderKey(d->results.at(i), context);
+        if (processor->lookupRendered(key, d->results[i])) {
+            continue;
+        }
+
+        d->messages << d->results.at(i);
+        d->rows << i;
+        d->keys << key;
+    }
+    d->scans = processor->triggerScanner.scan(d->messages);
+
+    // nothing to do if everything was cached
+    const QList<FilterPlugin> filters = d->messages.isEmpty() ? QList<FilterPlugin>() : processor->filters;
+    Q_FOREACH (const FilterPlugin &plugin, filters) {
+        const bool reentrant = plugin.instance->isReentrant();
+        if (d->steps.isEmpty() || d->stepIsReentrant.last() != reentrant) {
+            d->steps << QList<FilterPlugin>();
+            d->stepIsReentrant << reentrant;
+        }
+        d->steps.last() << plugin;
+    }
+
+    connect(&d->watcher, SIGNAL(finished()), SLOT(onWorkerFinished()));
+
+    // let the caller connect to finished() first
+    QTimer::singleShot(0, this, SLOT(processNext()));
+}
+
+PendingMessageProcessing::~PendingMessageProcessing()
+{
+    d->watcher.waitForFinished();
+    delete d;
+}
+
+QList<KTp::Message> PendingMessageProcessing::messages() const
+{
+    return d->results;
+}
+
+void PendingMessageProcessing::processNext()
+{
+    while (d->nextStep < d->steps.size()) {
+        const QList<FilterPlugin> step = d->steps.at(d->nextStep);
+        const bool reentrant = d->stepIsReentrant.at(d->nextStep);
+        ++d->nextStep;
+
+        if (reentrant) {
+            d->watcher.setFuture(QtConcurrent::run(runReentrantFilters, step, d->messages, d->scans, d->account, d->channel, d->configVersion));
+            return;
+        }
+
+        MessageProcessor::Private *processor = MessageProcessor::instance()->d;
+        const KTp::MessageContext context(d->account, d->channel);
+        QElapsedTimer timer;
+        Q_FOREACH (const FilterPlugin &plugin, step) {
+            // the filter may have been unloaded while we were waiting for a worker,
+            // or suspended by the time budget earlier in this loop
+            if (!processor->filters.contains(plugin)) {
+                continue;
+            }
+            timer.start();
+            const int filtered = TriggerScanner::filterMessages(plugin.instance, plugin.triggers, d->messages, d->scans, context);
+            if (filtered > 0) {
+                processor->recordFilterTime(plugin, timer.nsecsElapsed() / 1000, filtered);
+            }
+        }
+    }
+
+    MessageProcessor::Private *processor = MessageProcessor::instance()->d;
+    // rendered with filters which are no longer loaded or configured like this, do not cache it
+    const bool current = processor->configVersion == d->configVersion;
+    for (int i = 0; i < d->messages.size(); ++i) {
+        d->results[d->rows.at(i)] = d->messages.at(i);
+        if (current) {
+            processor->insertRendered(d->keys.at(i), d->messages.at(i));
+        }
+    }
+
+    Q_EMIT finished(this);
+    deleteLater();
+}
+
+void PendingMessageProcessing::onWorkerFinished()
+{
+    const WorkerResult result = d->watcher.result();
+    d->messages = result.messages;
+
+    // workers do not block the GUI, so their filters only show up in the statistics
+    const QList<FilterPlugin> &step = d->steps.at(d->nextStep - 1);
+    for (int i = 0; i < result.filterTimes.size(); ++i) {
+        if (result.filterTimes.at(i) >= 0) {
+            MessageProcessor::instance()->d->recordFilterTime(step.at(i), result.filterTimes.at(i), result.filterCounts.at(i), false);
+        }
+    }
+
+    processNext();
+}
+
+#include "moc_pending-message-processing.cpp"
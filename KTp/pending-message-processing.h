@@ -0,0 +1,68 @@
+/*
+    Copyright (C) 2026  KDE Telepathy developers
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef KTP_PENDING_MESSAGE_PROCESSING_H
+#define KTP_PENDING_MESSAGE_PROCESSING_H
+
+#include <QObject>
+
+#include <KTp/message.h>
+#include <KTp/ktpcommoninternals_export.h>
+
+namespace KTp
+{
+
+/**
+ * \brief Result of MessageProcessor::processIncomingMessagesAsync()
+ *
+ * Filters that declare themselves reentrant process the messages on a worker
+ * thread, all other filters run on the thread that started the operation, in
+ * the usual filter order.
+ *
+ * finished() is emitted on the thread that started the operation, after which
+ * the object deletes itself.
+ */
+class KTPCOMMONINTERNALS_EXPORT PendingMessageProcessing : public QObject
+{
+    Q_OBJECT
+
+  public:
+    ~PendingMessageProcessing() override;
+
+    /** The processed messages, in the same order they were passed in */
+    QList<KTp::Message> messages() const;
+
+  Q_SIGNALS:
+    void finished(KTp::PendingMessageProcessing *self);
+
+  private Q_SLOTS:
+    void processNext();
+    void onWorkerFinished();
+
+  private:
+    explicit PendingMessageProcessing(const QList<KTp::Message> &messages, const KTp::MessageContext &context, QObject *parent = nullptr);
+
+    class Private;
+    Private * const d;
+
+    friend class MessageProcessor;
+};
+
+}
+
+#endif // KTP_PENDING_MESSAGE_PROCESSING_H
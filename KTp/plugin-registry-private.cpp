@@ -0,0 +1,282 @@
+/*
+    Copyright (C) 2026  KDE Telepathy developers
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "plugin-registry-private.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QLibrary>
+#include <QStandardPaths>
+#include <QtConcurrentRun>
+
+#include <KConfig>
+#include <KConfigGroup>
+#include <KPluginLoader>
+#include <KServiceTypeTrader>
+
+#include "ktp-debug.h"
+
+using namespace KTp;
+
+// Increase whenever the layout of the cache files changes
+static const int CacheVersion = 1;
+
+static qint64 modificationTime(const QString &path)
+{
+    const QFileInfo info(path);
+    if (!info.exists()) {
+        return -1;
+    }
+    return info.lastModified().toMSecsSinceEpoch();
+}
+
+// The directories holding the desktop files of services
+static QStringList serviceDirectories()
+{
+    return QStandardPaths::locateAll(QStandardPaths::GenericDataLocation, QLatin1String("kservices5"), QStandardPaths::LocateDirectory);
+}
+
+static QString entryFilePath(const KPluginInfo &plugin)
+{
+    const QString entryPath = plugin.entryPath();
+    if (entryPath.isEmpty() || QDir::isAbsolutePath(entryPath)) {
+        return entryPath;
+    }
+    return QStandardPaths::locate(QStandardPaths::GenericDataLocation, QLatin1String("kservices5/") + entryPath);
+}
+
+// Runs on a worker thread, the library stays loaded after the QLibrary is gone
+static bool loadLibrary(const QString &library)
+{
+    QLibrary lib(KPluginLoader::findPlugin(library));
+    if (!lib.load()) {
+        qCWarning(KTP_COMMONINTERNALS) << "error preloading plugin" << library << ":" << lib.errorString();
+        return false;
+    }
+    return true;
+}
+
+class PluginRegistry::Private
+{
+  public:
+    Private():
+        resolved(false)
+    { }
+
+    QString cacheFile() const;
+    bool readCache();
+    void writeCache();
+
+    QString serviceType;
+    QString constraint;
+
+    bool resolved;
+    KPluginInfo::List plugins;
+
+    QHash<QFutureWatcher<bool>*, KPluginInfo> loading;
+};
+
+QString PluginRegistry::Private::cacheFile() const
+{
+    QString name = serviceType;
+    name.replace(QLatin1Char('/'), QLatin1Char('_'));
+    return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+            + QLatin1String("/ktp/plugins-") + name;
+}
+
+bool PluginRegistry::Private::readCache()
+{
+    const QString fileName = cacheFile();
+    if (!QFile::exists(fileName)) {
+        return false;
+    }
+
+    KConfig cache(fileName, KConfig::SimpleConfig);
+    const KConfigGroup general = cache.group("General");
+    if (general.readEntry("Version", 0) != CacheVersion
+            || general.readEntry("Constraint", QString()) != constraint) {
+        return false;
+    }
+
+    // plugins were added or removed if any service directory changed
+    const QStringList directories = serviceDirectories();
+    if (general.readEntry("Directories", QStringList()) != directories) {
+        return false;
+    }
+    const QStringList directoryTimes = general.readEntry("DirectoryTimes", QStringList());
+    if (directoryTimes.size() != directories.size()) {
+        return false;
+    }
+    for (int i = 0; i < directories.size(); ++i) {
+        if (modificationTime(directories.at(i)) != directoryTimes.at(i).toLongLong()) {
+            return false;
+        }
+    }
+
+    KPluginInfo::List infos;
+    Q_FOREACH (const QString &groupName, cache.groupList()) {
+        if (!groupName.startsWith(QLatin1String("Plugin "))) {
+            continue;
+        }
+
+        const KConfigGroup group = cache.group(groupName);
+        const QString entry = group.readEntry("Entry", QString());
+        const QString library = group.readEntry("Library", QString());
+        if (modificationTime(entry) != group.readEntry("EntryTime", qint64(-1))
+                || modificationTime(library) != group.readEntry("LibraryTime", qint64(-1))) {
+            return false;
+        }
+
+        const KPluginInfo info(entry);
+        if (!info.isValid()) {
+            return false;
+        }
+        infos << info;
+    }
+
+    plugins = infos;
+    return true;
+}
+
+void PluginRegistry::Private::writeCache()
+{
+    const QString fileName = cacheFile();
+    QDir().mkpath(QFileInfo(fileName).absolutePath());
+
+    KConfig cache(fileName, KConfig::SimpleConfig);
+    Q_FOREACH (const QString &groupName, cache.groupList()) {
+        cache.deleteGroup(groupName);
+    }
+
+    const QStringList directories = serviceDirectories();
+    QStringList directoryTimes;
+    Q_FOREACH (const QString &directory, directories) {
+        directoryTimes << QString::number(modificationTime(directory));
+    }
+
+    KConfigGroup general = cache.group("General");
+    general.writeEntry("Version", CacheVersion);
+    general.writeEntry("Constraint", constraint);
+    general.writeEntry("Directories", directories);
+    general.writeEntry("DirectoryTimes", directoryTimes);
+
+    Q_FOREACH (const KPluginInfo &plugin, plugins) {
+        const QString entry = entryFilePath(plugin);
+        const QString library = KPluginLoader::findPlugin(plugin.libraryPath());
+        if (entry.isEmpty()) {
+            // we could not find it again from the cache, so do not cache anything
+            cache.deleteGroup("General");
+            break;
+        }
+
+        KConfigGroup group = cache.group(QLatin1String("Plugin ") + plugin.pluginName());
+        group.writeEntry("Entry", entry);
+        group.writeEntry("EntryTime", modificationTime(entry));
+        group.writeEntry("Library", library);
+        group.writeEntry("LibraryTime", modificationTime(library));
+    }
+
+    cache.sync();
+}
+
+PluginRegistry::PluginRegistry(const QString &serviceType, const QString &constraint, QObject *parent):
+    QObject(parent),
+    d(new Private)
+{
+    d->serviceType = serviceType;
+    d->constraint = constraint;
+}
+
+PluginRegistry::~PluginRegistry()
+{
+    // loading a library cannot be cancelled
+    Q_FOREACH (QFutureWatcher<bool> *watcher, d->loading.keys()) {
+        watcher->waitForFinished();
+    }
+    delete d;
+}
+
+KPluginInfo::List PluginRegistry::plugins()
+{
+    if (!d->resolved) {
+        if (!d->readCache()) {
+            qCDebug(KTP_COMMONINTERNALS) << "plugin cache for" << d->serviceType << "is out of date";
+            d->plugins = KPluginInfo::fromServices(KServiceTypeTrader::self()->query(d->serviceType, d->constraint));
+            d->writeCache();
+        }
+        d->resolved = true;
+    }
+
+    return d->plugins;
+}
+
+void PluginRegistry::preload(const KPluginInfo::List &plugins)
+{
+    Q_FOREACH (const KPluginInfo &plugin, plugins) {
+        QFutureWatcher<bool> *watcher = new QFutureWatcher<bool>(this);
+        connect(watcher, SIGNAL(finished()), SLOT(onLibraryLoaded()));
+        d->loading.insert(watcher, plugin);
+        watcher->setFuture(QtConcurrent::run(loadLibrary, plugin.libraryPath()));
+    }
+}
+
+bool PluginRegistry::isPreloading() const
+{
+    return !d->loading.isEmpty();
+}
+
+void PluginRegistry::waitForPreloaded()
+{
+    if (d->loading.isEmpty()) {
+        return;
+    }
+
+    while (!d->loading.isEmpty()) {
+        QFutureWatcher<bool> *watcher = d->loading.constBegin().key();
+        const KPluginInfo plugin = d->loading.take(watcher);
+        watcher->disconnect(this);
+        watcher->waitForFinished();
+        watcher->deleteLater();
+
+        Q_EMIT pluginReady(plugin);
+    }
+
+    Q_EMIT preloadFinished();
+}
+
+void PluginRegistry::onLibraryLoaded()
+{
+    QFutureWatcher<bool> *watcher = static_cast<QFutureWatcher<bool>*>(sender());
+    watcher->deleteLater();
+
+    // waitForPreloaded() may have taken care of it already
+    if (!d->loading.contains(watcher)) {
+        return;
+    }
+
+    // even if preloading failed, so that the usual plugin loading reports the error
+    Q_EMIT pluginReady(d->loading.take(watcher));
+
+    if (d->loading.isEmpty()) {
+        Q_EMIT preloadFinished();
+    }
+}
+
+#include "moc_plugin-registry-private.cpp"
@@ -0,0 +1,81 @@
+/*
+    Copyright (C) 2026  KDE Telepathy developers
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef KTP_PLUGIN_REGISTRY_PRIVATE_H
+#define KTP_PLUGIN_REGISTRY_PRIVATE_H
+
+#include <QObject>
+
+#include <KPluginInfo>
+
+#include <KTp/ktpcommoninternals_export.h>
+
+namespace KTp
+{
+
+/**
+ * \brief Finds the plugins of a service type and loads their libraries in the background
+ *
+ * The metadata of the plugins is kept in a cache on disk, so the service type
+ * trader is only queried again when the cache is out of date. That is checked
+ * against the modification times of the service directories, of the plugin
+ * desktop files and of the plugin libraries.
+ *
+ * Loading a library is what takes time, so preload() does it on worker threads
+ * and pluginReady() tells when a plugin can be instantiated without blocking.
+ * Plugins themselves are still instantiated on the thread of the registry.
+ */
+class KTPCOMMONINTERNALS_EXPORT PluginRegistry : public QObject
+{
+    Q_OBJECT
+
+  public:
+    /** @p serviceType and @p constraint as for KServiceTypeTrader::query() */
+    PluginRegistry(const QString &serviceType, const QString &constraint, QObject *parent = nullptr);
+    ~PluginRegistry() override;
+
+    /** The metadata of all plugins of the service type */
+    KPluginInfo::List plugins();
+
+    /** Loads the libraries of @p plugins on worker threads, see pluginReady() */
+    void preload(const KPluginInfo::List &plugins);
+
+    /** Whether some of the libraries passed to preload() are still loading */
+    bool isPreloading() const;
+
+    /** Blocks until every library passed to preload() is loaded, and emits the outstanding pluginReady() */
+    void waitForPreloaded();
+
+  Q_SIGNALS:
+    /** The library of @p plugin is loaded, creating its factory no longer blocks */
+    void pluginReady(const KPluginInfo &plugin);
+
+    /** No library is loading anymore */
+    void preloadFinished();
+
+  private Q_SLOTS:
+    void onLibraryLoaded();
+
+  private:
+    class Private;
+    Private * const d;
+};
+
+}
+
+#endif // KTP_PLUGIN_REGISTRY_PRIVATE_H
@@ -22,6 +22,7 @@
 #include "text-parser.h"
 
 #include <QtCore/QLatin1String>
+#include <QtCore/QMutex>
 
 namespace KTp
 {
@@ -29,10 +30,356 @@ namespace KTp
 TextParser* TextParser::s_instance = nullptr;
 
 /**
- * RegExp for url detection
+ * URL and email detection
+ *
+ * This used to be a single backtracking QRegExp which could take exponential
+ * time on hostile input. The scanner below recognizes exactly the same
+ * language with a single left-to-right pass over the text:
+ *
+ *   \b((?:(?:([a-z][\w\.-]+:/{1,3})|www\d{0,3}[.]|[a-z0-9.\-]+[.][a-z]{2,4}/)
+ *         (?:[^\s()<>]+|\(([^\s()<>]+|(\([^\s()<>]+\)))*\))+
+ *         (?:\(([^\s()<>]+|(\([^\s()<>]+\)))*\)|\}\]|[^\s`!()\[\]{};:'".,<>?«»“”‘’])
+ *     |[a-z0-9.\-+_]+@[a-z0-9.\-]+[.][a-z]{1,5}[^\s/`!()\[\]{};:'".,<>?«»“”‘’]))
+ *
+ * matched case insensitively, leftmost-longest. Every run that is looked at
+ * more than once is cached, so the cost stays linear in the length of the text.
  */
-static QRegExp s_urlPattern(QString::fromLatin1("\\b((?:(?:([a-z][\\w\\.-]+:/{1,3})|www\\d{0,3}[.]|[a-z0-9.\\-]+[.][a-z]{2,4}/)(?:[^\\s()<>]+|\\(([^\\s()<>]+|(\\([^\\s()<>]+\\)))*\\))+(?:\\(([^\\s()<>]+|(\\([^\\s()<>]+\\)))*\\)|\\}\\]|[^\\s`!()\\[\\]{};:'\".,<>?%1%2%3%4%5%6])|[a-z0-9.\\-+_]+@[a-z0-9.\\-]+[.][a-z]{1,5}[^\\s/`!()\\[\\]{};:'\".,<>?%1%2%3%4%5%6]))")
-                            .arg(QChar(0x00AB)).arg(QChar(0x00BB)).arg(QChar(0x201C)).arg(QChar(0x201D)).arg(QChar(0x2018)).arg(QChar(0x2019)));
+namespace
+{
+
+inline bool isAsciiLetter(QChar c)
+{
+    const ushort u = c.unicode() | 0x20;
+    return u >= 'a' && u <= 'z';
+}
+
+inline bool isAsciiDigit(QChar c)
+{
+    return c.unicode() >= '0' && c.unicode() <= '9';
+}
+
+inline bool isWordChar(QChar c)
+{
+    return c.isLetterOrNumber() || c.isMark() || c == QLatin1Char('_');
+}
+
+// [^\s()<>]
+inline bool isBodyChar(QChar c)
+{
+    switch (c.unicode()) {
+    case '(': case ')': case '<': case '>':
+        return false;
+    default:
+        return !c.isSpace();
+    }
+}
+
+// [^\s`!()\[\]{};:'".,<>?«»“”‘’], also excluding '/' for email addresses
+inline bool isTerminatorChar(QChar c, bool email)
+{
+    switch (c.unicode()) {
+    case '`': case '!': case '(': case ')': case '[': case ']': case '{': case '}':
+    case ';': case ':': case '\'': case '"': case '.': case ',': case '<': case '>': case '?':
+    case 0x00AB: case 0x00BB: case 0x201C: case 0x201D: case 0x2018: case 0x2019:
+        return false;
+    case '/':
+        return !email;
+    default:
+        return !c.isSpace();
+    }
+}
+
+// [\w\.-]
+inline bool isSchemeChar(QChar c)
+{
+    return isWordChar(c) || c == QLatin1Char('.') || c == QLatin1Char('-');
+}
+
+// [a-z0-9.\-]
+inline bool isHostChar(QChar c)
+{
+    return isAsciiLetter(c) || isAsciiDigit(c) || c == QLatin1Char('.') || c == QLatin1Char('-');
+}
+
+// [a-z0-9.\-+_]
+inline bool isLocalPartChar(QChar c)
+{
+    return isHostChar(c) || c == QLatin1Char('+') || c == QLatin1Char('_');
+}
+
+class UrlScanner
+{
+public:
+    explicit UrlScanner(const QString &text);
+
+    /**
+     * Finds the next URL or email address at or after @p from.
+     * @p hasScheme is set when the match starts with an explicit "scheme:/".
+     */
+    bool next(int from, int *start, int *length, bool *hasScheme);
+
+private:
+    struct Run {
+        Run() : start(-1), end(-1) {}
+        int start;
+        int end;
+    };
+
+    template<bool (*Pred)(QChar)>
+    int runEnd(Run &cache, int from);
+
+    bool isWordBoundary(int pos) const;
+    int matchAt(int pos, bool *hasScheme);
+    int groupEnd(int pos) const;
+    int bodyEnd(int bodyStart);
+    int emailEnd(int atPos);
+
+    const QChar *m_text;
+    const int m_size;
+
+    Run m_schemeRun;
+    Run m_hostRun;
+    Run m_localPartRun;
+
+    int m_lastBodyStart;
+    int m_lastBodyEnd;
+    int m_lastAtPos;
+    int m_lastEmailEnd;
+};
+
+UrlScanner::UrlScanner(const QString &text)
+    : m_text(text.constData()),
+      m_size(text.size()),
+      m_lastBodyStart(-1),
+      m_lastBodyEnd(-1),
+      m_lastAtPos(-1),
+      m_lastEmailEnd(-1)
+{
+}
+
+template<bool (*Pred)(QChar)>
+int UrlScanner::runEnd(Run &cache, int from)
+{
+    // any position inside a run we already measured ends where that run ends
+    if (from >= cache.start && from < cache.end) {
+        return cache.end;
+    }
+
+    int end = from;
+    while (end < m_size && Pred(m_text[end])) {
+        ++end;
+    }
+
+    cache.start = from;
+    cache.end = end;
+    return end;
+}
+
+bool UrlScanner::isWordBoundary(int pos) const
+{
+    const bool previousIsWord = pos > 0 && isWordChar(m_text[pos - 1]);
+    return previousIsWord != isWordChar(m_text[pos]);
+}
+
+// Returns the position just after a balanced "(...)" or "(..(..)..)" group
+// starting at @p pos, or -1 if there is none
+int UrlScanner::groupEnd(int pos) const
+{
+    int i = pos + 1;
+    while (i < m_size) {
+        const QChar c = m_text[i];
+        if (c == QLatin1Char(')')) {
+            return i + 1;
+        }
+        if (c == QLatin1Char('(')) {
+            int j = i + 1;
+            while (j < m_size && isBodyChar(m_text[j])) {
+                ++j;
+            }
+            if (j == i + 1 || j >= m_size || m_text[j] != QLatin1Char(')')) {
+                return -1;
+            }
+            i = j + 1;
+            continue;
+        }
+        if (!isBodyChar(c)) {
+            return -1;
+        }
+        ++i;
+    }
+    return -1;
+}
+
+// Returns the end of the longest URL body + terminator starting at @p bodyStart, or -1
+int UrlScanner::bodyEnd(int bodyStart)
+{
+    if (bodyStart == m_lastBodyStart) {
+        return m_lastBodyEnd;
+    }
+
+    int pos = bodyStart;
+    int end = -1;
+    while (pos < m_size) {
+        const QChar c = m_text[pos];
+        if (c == QLatin1Char('(')) {
+            const int close = groupEnd(pos);
+            if (close < 0) {
+                break;
+            }
+            // a group is also a valid terminator once the body is not empty
+            if (pos > bodyStart) {
+                end = close;
+            }
+            pos = close;
+            continue;
+        }
+        if (!isBodyChar(c)) {
+            break;
+        }
+        if (pos > bodyStart) {
+            if (isTerminatorChar(c, false)) {
+                end = pos + 1;
+            } else if (c == QLatin1Char(']') && m_text[pos - 1] == QLatin1Char('}') && pos - 1 > bodyStart) {
+                end = pos + 1;
+            }
+        }
+        ++pos;
+    }
+
+    m_lastBodyStart = bodyStart;
+    m_lastBodyEnd = end;
+    return end;
+}
+
+// Returns the end of the longest "domain.tld" + terminator after the '@' at @p atPos, or -1
+int UrlScanner::emailEnd(int atPos)
+{
+    if (atPos == m_lastAtPos) {
+        return m_lastEmailEnd;
+    }
+
+    int end = -1;
+    for (int dot = atPos + 1; dot < m_size && isHostChar(m_text[dot]); ++dot) {
+        if (m_text[dot] != QLatin1Char('.') || dot < atPos + 2) {
+            continue;
+        }
+
+        // [a-z]{1,5} followed by a terminator, which may itself be a letter
+        int letters = 0;
+        while (letters < 6 && dot + 1 + letters < m_size && isAsciiLetter(m_text[dot + 1 + letters])) {
+            ++letters;
+        }
+
+        int candidate = -1;
+        if (letters == 6) {
+            candidate = dot + 7;
+        } else if (letters > 0) {
+            if (dot + 1 + letters < m_size && isTerminatorChar(m_text[dot + 1 + letters], true)) {
+                candidate = dot + 2 + letters;
+            } else if (letters > 1) {
+                candidate = dot + 1 + letters;
+            }
+        }
+        end = qMax(end, candidate);
+    }
+
+    m_lastAtPos = atPos;
+    m_lastEmailEnd = end;
+    return end;
+}
+
+// Returns the end of the longest match starting at @p pos, or -1
+int UrlScanner::matchAt(int pos, bool *hasScheme)
+{
+    if (!isWordBoundary(pos)) {
+        return -1;
+    }
+
+    const QChar c = m_text[pos];
+    int end = -1;
+
+    // [a-z][\w\.-]+:/{1,3}
+    if (isAsciiLetter(c)) {
+        const int colon = runEnd<isSchemeChar>(m_schemeRun, pos + 1);
+        if (colon >= pos + 2 && colon + 1 < m_size
+                && m_text[colon] == QLatin1Char(':') && m_text[colon + 1] == QLatin1Char('/')) {
+            // further slashes are simply part of the body
+            const int candidate = bodyEnd(colon + 2);
+            if (candidate > end) {
+                end = candidate;
+                *hasScheme = true;
+            }
+        }
+    }
+
+    // www\d{0,3}[.]
+    if (pos + 3 < m_size && (c.unicode() | 0x20) == 'w'
+            && (m_text[pos + 1].unicode() | 0x20) == 'w' && (m_text[pos + 2].unicode() | 0x20) == 'w') {
+        int dot = pos + 3;
+        while (dot < m_size && dot < pos + 6 && m_text[dot].isDigit()) {
+            ++dot;
+        }
+        if (dot < m_size && m_text[dot] == QLatin1Char('.')) {
+            const int candidate = bodyEnd(dot + 1);
+            if (candidate > end) {
+                end = candidate;
+                *hasScheme = false;
+            }
+        }
+    }
+
+    // [a-z0-9.\-]+[.][a-z]{2,4}/
+    if (isHostChar(c)) {
+        const int slash = runEnd<isHostChar>(m_hostRun, pos);
+        if (slash < m_size && m_text[slash] == QLatin1Char('/')) {
+            for (int tld = 1; tld <= 4; ++tld) {
+                const int dot = slash - tld - 1;
+                if (dot < pos + 1 || !isAsciiLetter(m_text[slash - tld])) {
+                    break;
+                }
+                if (tld >= 2 && m_text[dot] == QLatin1Char('.')) {
+                    const int candidate = bodyEnd(slash + 1);
+                    if (candidate > end) {
+                        end = candidate;
+                        *hasScheme = false;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    // [a-z0-9.\-+_]+@[a-z0-9.\-]+[.][a-z]{1,5}
+    if (isLocalPartChar(c)) {
+        const int at = runEnd<isLocalPartChar>(m_localPartRun, pos);
+        if (at < m_size && m_text[at] == QLatin1Char('@')) {
+            const int candidate = emailEnd(at);
+            if (candidate > end) {
+                end = candidate;
+                *hasScheme = false;
+            }
+        }
+    }
+
+    return end;
+}
+
+bool UrlScanner::next(int from, int *start, int *length, bool *hasScheme)
+{
+    for (int pos = from; pos < m_size; ++pos) {
+        bool scheme = false;
+        const int end = matchAt(pos, &scheme);
+        if (end > pos) {
+            *start = pos;
+            *length = end - pos;
+            *hasScheme = scheme;
+            return true;
+        }
+    }
+    return false;
+}
+
+}
 
 TextParser::TextParser(QObject* parent)
     : QObject(parent)
@@ -41,6 +388,9 @@ TextParser::TextParser(QObject* parent)
 
 TextParser* TextParser::instance()
 {
+    // message filters may run on worker threads
+    static QMutex mutex;
+    QMutexLocker locker(&mutex);
     if (!s_instance) {
         s_instance = new TextParser(nullptr);
     }
@@ -51,29 +401,26 @@ TextParser* TextParser::instance()
 TextUrlData TextParser::extractUrlData(const QString& text, bool doUrlFixup)
 {
     TextUrlData data;
-    QString htmlText(text);
-    s_urlPattern.setCaseSensitivity(Qt::CaseInsensitive);
+    UrlScanner scanner(text);
 
     int pos = 0;
     int urlLen = 0;
+    bool hasScheme = false;
 
     QString protocol;
     QString href;
 
-    while ((pos = s_urlPattern.indexIn(htmlText, pos)) >= 0) {
-        urlLen = s_urlPattern.matchedLength();
-        href = htmlText.mid(pos, urlLen);
-
-        data.urlRanges << QPair<int, int>(pos, href.length());
-        pos += href.length();
+    while (scanner.next(pos, &pos, &urlLen, &hasScheme)) {
+        data.urlRanges << QPair<int, int>(pos, urlLen);
 
         if (doUrlFixup) {
+            href = text.mid(pos, urlLen);
+
             protocol.clear();
-            if (s_urlPattern.cap(2).isEmpty()) {
-                QString urlPatternCap1(s_urlPattern.cap(1));
-                if (urlPatternCap1.contains(QLatin1Char('@'))) {
+            if (!hasScheme) {
+                if (href.contains(QLatin1Char('@'))) {
                     protocol = QLatin1String("mailto:");
-                } else if (urlPatternCap1.startsWith(QLatin1String("ftp."), Qt::CaseInsensitive)) {
+                } else if (href.startsWith(QLatin1String("ftp."), Qt::CaseInsensitive)) {
                     protocol = QLatin1String("ftp://");
                 } else {
                     protocol = QLatin1String("http://");
@@ -83,6 +430,8 @@ TextUrlData TextParser::extractUrlData(const QString& text, bool doUrlFixup)
             href = protocol + href;
             data.fixedUrls.append(href);
         }
+
+        pos += urlLen;
     }
     return data;
 }
@@ -84,10 +84,11 @@ namespace KTp
 
         ContactUriRole,
         ContactVCardRole, ///< VCard of the contact in KContacts::Addresse format; KPeople only at the moment
+        ContactSearchScoreRole, ///< real. how well the contact matches the global filter, KTp::ContactsFilterModel::FuzzySearch only
 
         //heading roles
-        HeaderTotalUsersRole = Qt::UserRole  + 3000,
-        HeaderOnlineUsersRole,
+        HeaderTotalUsersRole = Qt::UserRole  + 3000, ///< int. members of an account or group heading
+        HeaderOnlineUsersRole, ///< int. rows of a heading which pass the filters, KTp::ContactsFilterModel only
 
         CustomRole = Qt::UserRole + 4000 // a placemark for custom roles in inherited models
     };
@@ -199,7 +199,8 @@ QList<QAction*> KPeopleActionsPlugin::actionsForPerson(const KPeople::PersonData
             continue;
         }
 
-        if (contact->textChatCapability()) {
+        const KTp::Contact::Capabilities capabilities = contact->capabilityFlags();
+        if (capabilities & KTp::Contact::TextChatCapability) {
             QAction *action = new IMAction(i18n("Start Chat Using %1...", account->displayName()),
                                 QIcon::fromTheme(QStringLiteral("text-x-generic")),
                                 contact,
@@ -209,7 +210,7 @@ QList<QAction*> KPeopleActionsPlugin::actionsForPerson(const KPeople::PersonData
             connect (action, SIGNAL(triggered(bool)), SLOT(onActionTriggered()));
             actions << action;
         }
-        if (contact->audioCallCapability()) {
+        if (capabilities & KTp::Contact::AudioCallCapability) {
             QAction *action = new IMAction(i18n("Start Audio Call Using %1...", account->displayName()),
                                 QIcon::fromTheme(QStringLiteral("audio-headset")),
                                 contact,
@@ -219,7 +220,7 @@ QList<QAction*> KPeopleActionsPlugin::actionsForPerson(const KPeople::PersonData
             connect (action, SIGNAL(triggered(bool)), SLOT(onActionTriggered()));
             actions << action;
         }
-        if (contact->videoCallCapability()) {
+        if (capabilities & KTp::Contact::VideoCallCapability) {
             QAction *action = new IMAction(i18n("Start Video Call Using %1...", account->displayName()),
                                 QIcon::fromTheme(QStringLiteral("camera-web")),
                                 contact,
@@ -230,7 +231,7 @@ QList<QAction*> KPeopleActionsPlugin::actionsForPerson(const KPeople::PersonData
             actions << action;
         }
 
-        if (contact->fileTransferCapability()) {
+        if (capabilities & KTp::Contact::FileTransferCapability) {
             QAction *action = new IMAction(i18n("Send Files Using %1...", account->displayName()),
                                         QIcon::fromTheme(QStringLiteral("mail-attachment")),
                                         contact,
@@ -240,7 +241,7 @@ QList<QAction*> KPeopleActionsPlugin::actionsForPerson(const KPeople::PersonData
             connect (action, SIGNAL(triggered(bool)), SLOT(onActionTriggered()));
             actions << action;
         }
-        if (contact->collaborativeEditingCapability()) {
+        if (capabilities & KTp::Contact::CollaborativeEditingCapability) {
             QAction *action = new IMAction(i18n("Collaboratively edit a document Using %1...", account->displayName()),
                                         QIcon::fromTheme(QStringLiteral("document-edit")),
                                         contact,
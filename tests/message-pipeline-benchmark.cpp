@@ -0,0 +1,452 @@
+/*
+ * Benchmarks of the message processing pipeline
+ *
+ * Copyright (C) 2026  KDE Telepathy developers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Runs without any Telepathy service: messages are built directly and
+ * processed with an empty context.
+ *
+ * Run the run_message_pipeline_benchmark target to get the results in
+ * message-pipeline-benchmark.xml, or pass the usual QTest options, e.g.
+ * "-csv" or "-o results.xml,xml". The allocations test reports heap
+ * allocations per message, it needs glibc to count them.
+ */
+
+#include <QtTest>
+
+#include <atomic>
+
+#include "KTp/message-private.h"
+#include "KTp/message-filters-private.h"
+#include "KTp/message-processor.h"
+#include "KTp/outgoing-message.h"
+#include "KTp/text-parser.h"
+
+#if defined(__GLIBC__)
+#define COUNT_ALLOCATIONS 1
+
+static std::atomic<quint64> s_allocations(0);
+
+// glibc's own allocator, which the overrides below forward to
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void __libc_free(void *ptr);
+
+extern "C" void *malloc(size_t size)
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+#endif
+
+// Builds messages without a Tp::Message and a connection behind them
+class CorpusMessage : public KTp::Message
+{
+  public:
+    explicit CorpusMessage(const QString &text, int serial):
+        KTp::Message(new KTp::Message::Private)
+    {
+        d->mainPart = text;
+        d->messageType = Tp::ChannelTextMessageTypeNormal;
+        d->direction = KTp::Message::RemoteToLocal;
+        d->sentTime = QDateTime::fromMSecsSinceEpoch(Q_INT64_C(1700000000000) + serial * 1000);
+        d->token = QString::fromLatin1("benchmark-%1").arg(serial);
+        d->senderId = QLatin1String("someone@example.org");
+        d->senderAlias = QLatin1String("Someone");
+    }
+};
+
+// A deterministic generator, so that every run uses the same corpus
+class Corpus
+{
+  public:
+    Corpus(): m_state(20260101) { }
+
+    QString plainChat(int lines);
+    QString urlDense(int lines);
+    QString emailDense(int lines);
+    QString paste(int bytes);
+    QString nonLatin(int lines);
+    QString adversarial(int length);
+
+  private:
+    int next(int bound);
+    QString word();
+    QString sentence(int words);
+
+    quint32 m_state;
+};
+
+int Corpus::next(int bound)
+{
+    m_state = m_state * 1103515245u + 12345u;
+    return int((m_state >> 8) % quint32(bound));
+}
+
+QString Corpus::word()
+{
+    static const char *words[] = {
+        "hello", "the", "meeting", "is", "at", "noon", "did", "you", "see", "this",
+        "build", "broke", "again", "lol", "thanks", "patch", "review", "tomorrow", "ok", "sure"
+    };
+    return QLatin1String(words[next(sizeof(words) / sizeof(words[0]))]);
+}
+
+QString Corpus::sentence(int words)
+{
+    QStringList out;
+    for (int i = 0; i < words; ++i) {
+        out << word();
+    }
+    return out.join(QLatin1Char(' '));
+}
+
+QString Corpus::plainChat(int lines)
+{
+    QStringList out;
+    for (int i = 0; i < lines; ++i) {
+        out << sentence(4 + next(12)) + QLatin1String(next(3) ? "" : " :)");
+    }
+    return out.join(QLatin1Char('\n'));
+}
+
+QString Corpus::urlDense(int lines)
+{
+    static const char *urls[] = {
+        "http://kde.org", "https://bugs.kde.org/show_bug.cgi?id=%1", "www.example.com/path/%1",
+        "ftp.kde.org/pub", "https://en.wikipedia.org/wiki/Foo_(bar)", "example.net/a/b/c?x=%1&y=2"
+    };
+
+    QStringList out;
+    for (int i = 0; i < lines; ++i) {
+        out << sentence(2 + next(4)) + QLatin1Char(' ')
+               + QString::fromLatin1(urls[next(sizeof(urls) / sizeof(urls[0]))]).arg(next(100000))
+               + QLatin1Char(' ') + sentence(1 + next(3));
+    }
+    return out.join(QLatin1Char('\n'));
+}
+
+QString Corpus::emailDense(int lines)
+{
+    QStringList out;
+    for (int i = 0; i < lines; ++i) {
+        out << sentence(2 + next(4))
+               + QString::fromLatin1(" %1.%2@mail%3.example.org ").arg(word(), word()).arg(next(50))
+               + sentence(1 + next(3));
+    }
+    return out.join(QLatin1Char('\n'));
+}
+
+QString Corpus::paste(int bytes)
+{
+    QString out;
+    out.reserve(bytes + 200);
+    int line = 0;
+    while (out.size() < bytes) {
+        if (next(4) == 0) {
+            // a base64 blob line
+            for (int i = 0; i < 76; ++i) {
+                out += QLatin1Char("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[next(64)]);
+            }
+        } else {
+            out += QString::fromLatin1("2026-01-01 12:00:%1 [worker-%2] <debug> %3 & \"%4\" took %5ms")
+                       .arg(line % 60, 2, 10, QLatin1Char('0'))
+                       .arg(next(8))
+                       .arg(sentence(6), word())
+                       .arg(next(1000));
+        }
+        out += QLatin1Char('\n');
+        ++line;
+    }
+    return out;
+}
+
+QString Corpus::nonLatin(int lines)
+{
+    static const char *phrases[] = {
+        "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82, \xd0\xba\xd0\xb0\xd0\xba \xd0\xb4\xd0\xb5\xd0\xbb\xd0\xb0?",
+        "\xe4\xbd\xa0\xe5\xa5\xbd\xef\xbc\x8c\xe6\x98\x8e\xe5\xa4\xa9\xe8\xa7\x81",
+        "\xd9\x85\xd8\xb1\xd8\xad\xd8\xa8\xd8\xa7 \xd8\xa8\xd9\x83",
+        "\xe3\x81\x93\xe3\x82\x93\xe3\x81\xab\xe3\x81\xa1\xe3\x81\xaf",
+        "\xf0\x9f\x98\x80\xf0\x9f\x8e\x89 \xf0\x9f\x91\x8d",
+        "\xce\x93\xce\xb5\xce\xb9\xce\xb1 \xcf\x83\xce\xbf\xcf\x85 \xce\xba\xcf\x8c\xcf\x83\xce\xbc\xce\xb5"
+    };
+
+    QStringList out;
+    for (int i = 0; i < lines; ++i) {
+        out << QString::fromUtf8(phrases[next(sizeof(phrases) / sizeof(phrases[0]))])
+               + QLatin1Char(' ') + QString::fromUtf8(phrases[next(sizeof(phrases) / sizeof(phrases[0]))]);
+    }
+    return out.join(QLatin1Char('\n'));
+}
+
+QString Corpus::adversarial(int length)
+{
+    // the kind of input which made the old backtracking URL pattern explode:
+    // long runs that almost look like hosts, local parts and paths
+    QString out;
+    out.reserve(length + 20);
+    while (out.size() < length) {
+        switch (next(4)) {
+        case 0:
+            out += QLatin1String("a.a.a.a.a.a.a.a.a.a.a.a.a-");
+            break;
+        case 1:
+            out += QLatin1String("aaaaaaaaaaaaaaaaaaaa@");
+            break;
+        case 2:
+            out += QLatin1String("www.x_x_x_x_x_x_x_x_x_x_");
+            break;
+        default:
+            out += QLatin1String("http://(((((((((((");
+            break;
+        }
+    }
+    return out;
+}
+
+class MessagePipelineBenchmark : public QObject
+{
+    Q_OBJECT
+
+  private Q_SLOTS:
+    void initTestCase();
+
+    void extractUrlData_data();
+    void extractUrlData();
+
+    void escapeFilter_data();
+    void escapeFilter();
+
+    void processIncomingMessage_data();
+    void processIncomingMessage();
+
+    void processOutgoingMessage_data();
+    void processOutgoingMessage();
+
+    void finalizedMessage_data();
+    void finalizedMessage();
+
+    void allocations_data();
+    void allocations();
+
+  private:
+    void addCorpus();
+
+    QList<QPair<QByteArray, QString> > m_corpus;
+};
+
+void MessagePipelineBenchmark::initTestCase()
+{
+    Corpus corpus;
+    m_corpus << qMakePair(QByteArray("plain-chat"), corpus.plainChat(1));
+    m_corpus << qMakePair(QByteArray("plain-chat-long"), corpus.plainChat(40));
+    m_corpus << qMakePair(QByteArray("url-dense"), corpus.urlDense(20));
+    m_corpus << qMakePair(QByteArray("email-dense"), corpus.emailDense(20));
+    m_corpus << qMakePair(QByteArray("non-latin"), corpus.nonLatin(20));
+    m_corpus << qMakePair(QByteArray("adversarial"), corpus.adversarial(20000));
+    m_corpus << qMakePair(QByteArray("paste-2MB"), corpus.paste(2 * 1024 * 1024));
+
+    // load the filters and the parser up front, not in the first measurement
+    KTp::MessageProcessor::instance();
+    KTp::TextParser::instance();
+}
+
+void MessagePipelineBenchmark::addCorpus()
+{
+    QTest::addColumn<QString>("text");
+
+    for (int i = 0; i < m_corpus.size(); ++i) {
+        QTest::newRow(m_corpus.at(i).first.constData()) << m_corpus.at(i).second;
+    }
+}
+
+void MessagePipelineBenchmark::extractUrlData_data()
+{
+    addCorpus();
+}
+
+void MessagePipelineBenchmark::extractUrlData()
+{
+    QFETCH(QString, text);
+
+    KTp::TextParser *parser = KTp::TextParser::instance();
+    QBENCHMARK {
+        parser->extractUrlData(text);
+    }
+}
+
+void MessagePipelineBenchmark::escapeFilter_data()
+{
+    addCorpus();
+}
+
+void MessagePipelineBenchmark::escapeFilter()
+{
+    QFETCH(QString, text);
+
+    MessageEscapeFilter filter;
+    const KTp::MessageContext context(Tp::AccountPtr(), Tp::TextChannelPtr());
+    const CorpusMessage raw(text, 1);
+
+    QBENCHMARK {
+        KTp::Message message(raw);
+        filter.filterMessage(message, context);
+    }
+}
+
+void MessagePipelineBenchmark::processIncomingMessage_data()
+{
+    addCorpus();
+}
+
+void MessagePipelineBenchmark::processIncomingMessage()
+{
+    QFETCH(QString, text);
+
+    KTp::MessageProcessor *processor = KTp::MessageProcessor::instance();
+    const KTp::MessageContext context(Tp::AccountPtr(), Tp::TextChannelPtr());
+    const CorpusMessage raw(text, 1);
+
+    // every iteration a miss, not a lookup in the render cache
+    KTp::Message processed(raw);
+    QBENCHMARK {
+        processor->clearRenderCache();
+        processed = processor->processIncomingMessage(raw, context);
+    }
+
+    // the paste has to be measured whole, not as a preview with the rest left to the event loop
+    QVERIFY(!processed.isPartial());
+}
+
+void MessagePipelineBenchmark::processOutgoingMessage_data()
+{
+    addCorpus();
+}
+
+void MessagePipelineBenchmark::processOutgoingMessage()
+{
+    QFETCH(QString, text);
+
+    KTp::MessageProcessor *processor = KTp::MessageProcessor::instance();
+
+    QBENCHMARK {
+        processor->processOutgoingMessage(text, Tp::AccountPtr(), Tp::TextChannelPtr());
+    }
+}
+
+void MessagePipelineBenchmark::finalizedMessage_data()
+{
+    addCorpus();
+}
+
+void MessagePipelineBenchmark::finalizedMessage()
+{
+    QFETCH(QString, text);
+
+    MessageEscapeFilter filter;
+    const KTp::MessageContext context(Tp::AccountPtr(), Tp::TextChannelPtr());
+    KTp::Message message = CorpusMessage(text, 1);
+    filter.filterMessage(message, context);
+    message.appendMessagePart(QLatin1String("<div class=\"preview\">preview</div>"));
+
+    QBENCHMARK {
+        message.finalizedMessage();
+    }
+}
+
+void MessagePipelineBenchmark::allocations_data()
+{
+    QTest::addColumn<QString>("stage");
+    QTest::addColumn<QString>("text");
+
+    const char *stages[] = { "extractUrlData", "escapeFilter", "processIncomingMessage", "finalizedMessage" };
+    for (const char *stage : stages) {
+        for (int i = 0; i < m_corpus.size(); ++i) {
+            const QByteArray name = QByteArray(stage) + ':' + m_corpus.at(i).first;
+            QTest::newRow(name.constData()) << QString::fromLatin1(stage) << m_corpus.at(i).second;
+        }
+    }
+}
+
+void MessagePipelineBenchmark::allocations()
+{
+#ifndef COUNT_ALLOCATIONS
+    QSKIP("counting allocations needs glibc");
+#else
+    QFETCH(QString, stage);
+    QFETCH(QString, text);
+
+    static const int Runs = 10;
+
+    KTp::MessageProcessor *processor = KTp::MessageProcessor::instance();
+    MessageEscapeFilter filter;
+    const KTp::MessageContext context(Tp::AccountPtr(), Tp::TextChannelPtr());
+    const CorpusMessage raw(text, 1);
+
+    KTp::Message escaped(raw);
+    filter.filterMessage(escaped, context);
+
+    quint64 allocations = 0;
+    // the first run warms up lazily created state and is not counted
+    for (int run = 0; run <= Runs; ++run) {
+        processor->clearRenderCache();
+        const quint64 before = s_allocations.load();
+
+        if (stage == QLatin1String("extractUrlData")) {
+            KTp::TextParser::instance()->extractUrlData(text);
+        } else if (stage == QLatin1String("escapeFilter")) {
+            KTp::Message message(raw);
+            filter.filterMessage(message, context);
+        } else if (stage == QLatin1String("processIncomingMessage")) {
+            processor->processIncomingMessage(raw, context);
+        } else {
+            escaped.finalizedMessage();
+        }
+
+        if (run > 0) {
+            allocations += s_allocations.load() - before;
+        }
+    }
+
+    QTest::setBenchmarkResult(qreal(allocations) / Runs, QTest::Events);
+#endif
+}
+
+QTEST_GUILESS_MAIN(MessagePipelineBenchmark)
+
+#include "message-pipeline-benchmark.moc"